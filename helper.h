@@ -1,6 +1,24 @@
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <map>
+#include <set>
+#include <numeric>
+#include <climits>
+#include <algorithm>
+#include <tuple>
+#include <thread>
+#include <mutex>
+#include <functional>
+#include <chrono>
+#include <exception>
+#include <sstream>
+#include <cstring>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include "seal/seal.h"
 
 using namespace std;
@@ -52,6 +70,37 @@ void print_parameters(shared_ptr<SEALContext> context)
     cout << "\\" << endl;
 }
 
+// HE session: context, keys, encryptor, evaluator, decryptor and encoder created once and shared by every routine
+// (creating a SEALContext recomputes the modulus chain and NTT tables, so it must not be done per call)
+struct HESession
+{
+    EncryptionParameters params;
+    shared_ptr<SEALContext> context;
+    KeyGenerator keygen;
+    PublicKey public_key;
+    SecretKey secret_key;
+    RelinKeys relin_keys;
+    GaloisKeys gal_keys;
+    Encryptor encryptor;
+    Evaluator evaluator;
+    Decryptor decryptor;
+    CKKSEncoder ckks_encoder;
+    double scale;
+
+    // Number of threads of the parallel loops (they share evaluator, see parallel_for)
+    int num_threads;
+
+    // Galois keys are generated for galois_steps only (see RotationPlan), or for all power of two steps if it is empty
+    HESession(const EncryptionParameters &parms, double scale, int num_threads = 1, const vector<int> &galois_steps = vector<int>())
+        : params(parms), context(SEALContext::Create(parms)), keygen(context),
+          public_key(keygen.public_key()), secret_key(keygen.secret_key()),
+          relin_keys(keygen.relin_keys()), gal_keys(galois_steps.empty() ? keygen.galois_keys() : keygen.galois_keys(galois_steps)),
+          encryptor(context, public_key), evaluator(context), decryptor(context, secret_key),
+          ckks_encoder(context), scale(scale), num_threads(max(1, num_threads))
+    {
+    }
+};
+
 // Helper function that prints a matrix (vector of vectors)
 template <typename T>
 inline void print_full_matrix(vector<vector<T>> matrix, int precision = 3)
@@ -208,387 +257,2829 @@ vector<vector<T>> get_all_diagonals(vector<vector<T>> U)
     return diagonal_matrix;
 }
 
-// Linear Transformation function between ciphertext matrix and ciphertext vector
-Ciphertext Linear_Transform_Cipher(Ciphertext ct, vector<Ciphertext> U_diagonals, GaloisKeys gal_keys, Evaluator &evaluator)
+// Matrix stored as its non-zero diagonals only: diagonals[l][i] = U[i][(i + l) % size], diagonals missing from the map are zero
+struct SparseDiagonals
 {
-    // Fill ct with duplicate
-    Ciphertext ct_rot;
-    evaluator.rotate_vector(ct, -U_diagonals.size(), gal_keys, ct_rot);
-    // cout << "U_diagonals.size() = " << U_diagonals.size() << endl;
-    Ciphertext ct_new;
-    evaluator.add(ct, ct_rot, ct_new);
+    int size;
+    map<int, vector<double>> diagonals;
+};
 
-    vector<Ciphertext> ct_result(U_diagonals.size());
-    evaluator.multiply(ct_new, U_diagonals[0], ct_result[0]);
+// Gets the non-zero diagonals of a permutation matrix, permutation[i] is the column of the 1 in row i
+SparseDiagonals get_permutation_diagonals(const vector<int> &permutation)
+{
+    int size = permutation.size();
+    SparseDiagonals sparse{size, {}};
 
-    for (int l = 1; l < U_diagonals.size(); l++)
+    for (int i = 0; i < size; i++)
     {
-        Ciphertext temp_rot;
-        evaluator.rotate_vector(ct_new, l, gal_keys, temp_rot);
-        evaluator.multiply(temp_rot, U_diagonals[l], ct_result[l]);
+        int l = (permutation[i] - i + size) % size;
+        auto it = sparse.diagonals.find(l);
+        if (it == sparse.diagonals.end())
+        {
+            it = sparse.diagonals.emplace(l, vector<double>(size, 0)).first;
+        }
+        it->second[i] = 1;
     }
-    Ciphertext ct_prime;
-    evaluator.add_many(ct_result, ct_prime);
 
-    return ct_prime;
+    return sparse;
 }
 
-// Linear Transformation function between plaintext  matrix and ciphertext vector
-Ciphertext Linear_Transform_Plain(Ciphertext ct, vector<Plaintext> U_diagonals, GaloisKeys gal_keys, EncryptionParameters params)
+// Dense permutation matrix, only for printing small examples
+vector<vector<double>> get_permutation_matrix(const vector<int> &permutation)
 {
-    auto context = SEALContext::Create(params);
-    Evaluator evaluator(context);
-
-    // Fill ct with duplicate
-    Ciphertext ct_rot;
-    evaluator.rotate_vector(ct, -U_diagonals.size(), gal_keys, ct_rot);
-    // cout << "U_diagonals.size() = " << U_diagonals.size() << endl;
-    Ciphertext ct_new;
-    evaluator.add(ct, ct_rot, ct_new);
-
-    vector<Ciphertext> ct_result(U_diagonals.size());
-    evaluator.multiply_plain(ct_new, U_diagonals[0], ct_result[0]);
-
-    for (int l = 1; l < U_diagonals.size(); l++)
+    int size = permutation.size();
+    vector<vector<double>> matrix(size, vector<double>(size, 0));
+    for (int i = 0; i < size; i++)
     {
-        Ciphertext temp_rot;
-        evaluator.rotate_vector(ct_new, l, gal_keys, temp_rot);
-        evaluator.multiply_plain(temp_rot, U_diagonals[l], ct_result[l]);
+        matrix[i][permutation[i]] = 1;
     }
-    Ciphertext ct_prime;
-    evaluator.add_many(ct_result, ct_prime);
 
-    return ct_prime;
+    return matrix;
 }
 
-// Linear transformation function between ciphertext matrix and plaintext vector
-Ciphertext Linear_Transform_CipherMatrix_PlainVector(vector<Plaintext> pt_rotations, vector<Ciphertext> U_diagonals, GaloisKeys gal_keys, Evaluator &evaluator)
+// Permutations of a dimension x dimension matrix encoded in row major order (index i * dimension + j)
+// U_sigma: A(i, j) -> A(i, i + j)
+vector<int> get_U_sigma_permutation(int dimension)
 {
-    vector<Ciphertext> ct_result(pt_rotations.size());
-
-    for (int i = 0; i < pt_rotations.size(); i++)
+    vector<int> permutation(dimension * dimension);
+    for (int i = 0; i < dimension; i++)
     {
-        evaluator.multiply_plain(U_diagonals[i], pt_rotations[i], ct_result[i]);
+        for (int j = 0; j < dimension; j++)
+        {
+            permutation[i * dimension + j] = i * dimension + (i + j) % dimension;
+        }
     }
 
-    Ciphertext ct_prime;
-    evaluator.add_many(ct_result, ct_prime);
-
-    return ct_prime;
+    return permutation;
 }
 
-template <typename T>
-vector<vector<double>> get_matrix_of_ones(int position, vector<vector<T>> U)
+// U_tau: A(i, j) -> A(i + j, j)
+vector<int> get_U_tau_permutation(int dimension)
 {
-    vector<vector<double>> diagonal_of_ones(U.size(), vector<double>(U.size()));
-    vector<T> U_diag = get_diagonal(position, U);
-
-    int k = 0;
-    for (int i = 0; i < U.size(); i++)
+    vector<int> permutation(dimension * dimension);
+    for (int i = 0; i < dimension; i++)
     {
-        for (int j = 0; j < U.size(); j++)
+        for (int j = 0; j < dimension; j++)
         {
-            if (U[i][j] == U_diag[k])
-            {
-                diagonal_of_ones[i][j] = 1;
-            }
-            else
-            {
-                diagonal_of_ones[i][j] = 0;
-            }
+            permutation[i * dimension + j] = ((i + j) % dimension) * dimension + j;
         }
-        k++;
     }
 
-    return diagonal_of_ones;
+    return permutation;
 }
 
-// Encodes Ciphertext Matrix into a single vector (Row ordering of a matix)
-Ciphertext C_Matrix_Encode(vector<Ciphertext> matrix, GaloisKeys gal_keys, Evaluator &evaluator)
+// V_k: A(i, j) -> A(i, j + k) (column shift)
+vector<int> get_V_k_permutation(int dimension, int k)
 {
-    Ciphertext ct_result;
-    int dimension = matrix.size();
-    vector<Ciphertext> ct_rots(dimension);
-    ct_rots[0] = matrix[0];
-
-    for (int i = 1; i < dimension; i++)
+    if (k < 1 || k >= dimension)
     {
-        evaluator.rotate_vector(matrix[i], (i * -dimension), gal_keys, ct_rots[i]);
+        cerr << "Invalid K for matrix V_k: " << to_string(k) << ". Choose k to be between 1 and " << to_string(dimension) << endl;
+        exit(1);
     }
 
-    evaluator.add_many(ct_rots, ct_result);
+    vector<int> permutation(dimension * dimension);
+    for (int i = 0; i < dimension; i++)
+    {
+        for (int j = 0; j < dimension; j++)
+        {
+            permutation[i * dimension + j] = i * dimension + (j + k) % dimension;
+        }
+    }
 
-    return ct_result;
+    return permutation;
 }
 
-// Decodes Ciphertext Matrix into vector of Ciphertexts
-vector<Ciphertext> C_Matrix_Decode(Ciphertext matrix, int dimension, double scale, GaloisKeys gal_keys, CKKSEncoder &ckks_encoder, Evaluator &evaluator)
+// W_k: A(i, j) -> A(i + k, j) (row shift)
+vector<int> get_W_k_permutation(int dimension, int k)
 {
+    if (k < 1 || k >= dimension)
+    {
+        cerr << "Invalid K for matrix W_k: " << to_string(k) << ". Choose k to be between 1 and " << to_string(dimension) << endl;
+        exit(1);
+    }
 
-    vector<Ciphertext> ct_result(dimension);
+    vector<int> permutation(dimension * dimension);
     for (int i = 0; i < dimension; i++)
     {
-        // Create masks vector with 1s and 0s
-        // Fill mask vector with 0s
-        vector<double> mask_vec(pow(dimension, 2), 0);
-
-        // Store 1s in mask vector at dimension offset. Offset = j + (i * dimension)
         for (int j = 0; j < dimension; j++)
         {
-            mask_vec[j + (i * dimension)] = 1;
+            permutation[i * dimension + j] = ((i + k) % dimension) * dimension + j;
         }
+    }
 
-        // Encode mask vector
-        Plaintext mask_pt;
-        ckks_encoder.encode(mask_vec, scale, mask_pt);
-
-        // multiply matrix with mask
-        Ciphertext ct_row;
-        evaluator.multiply_plain(matrix, mask_pt, ct_row);
+    return permutation;
+}
 
-        // rotate row (not the first one)
-        if (i != 0)
+// U_transpose: A(i, j) -> A(j, i)
+vector<int> get_U_transpose_permutation(int dimension)
+{
+    vector<int> permutation(dimension * dimension);
+    for (int i = 0; i < dimension; i++)
+    {
+        for (int j = 0; j < dimension; j++)
         {
-            evaluator.rotate_vector_inplace(ct_row, i * dimension, gal_keys);
+            permutation[i * dimension + j] = j * dimension + i;
         }
-
-        // store in result
-        ct_result[i] = ct_row;
     }
 
-    return ct_result;
+    return permutation;
 }
 
-template <typename T>
-vector<double> pad_zero(int offset, vector<T> U_vec)
+// Gets the Galois element of a vector rotation by steps (same computation as SEAL's GaloisTool)
+uint32_t galois_elt_from_step(int steps, size_t poly_modulus_degree)
 {
-
-    vector<double> result_vec(pow(U_vec.size(), 2));
-    // Fill before U_vec
-    for (int i = 0; i < offset; i++)
+    uint32_t n = poly_modulus_degree;
+    uint32_t m = 2 * n;
+    uint32_t pos_steps = abs(steps);
+    if (pos_steps >= (n >> 1))
     {
-        result_vec[i] = 0;
+        throw invalid_argument("step count too large");
     }
-    // Fill U_vec
-    for (int i = 0; i < U_vec.size(); i++)
-    {
-        result_vec[i + offset] = U_vec[i];
-    }
-    // Fill after U_vec
-    for (int i = offset + U_vec.size(); i < result_vec.size(); i++)
+    uint32_t exponent = (steps < 0) ? (n >> 1) - pos_steps : pos_steps;
+
+    uint32_t galois_elt = 1;
+    for (uint32_t i = 0; i < exponent; i++)
     {
-        result_vec[i] = 0;
+        galois_elt = (galois_elt * 3) & (m - 1);
     }
-    return result_vec;
+
+    return galois_elt;
 }
 
-// U_transpose
-template <typename T>
-vector<vector<double>> get_U_transpose(vector<vector<T>> U)
+// Checks if the Galois keys can rotate by steps with a single key switch
+bool has_rotation_key(int steps, const GaloisKeys &gal_keys, size_t poly_modulus_degree)
+{
+    return gal_keys.has_key(galois_elt_from_step(steps, poly_modulus_degree));
+}
+
+// Batch rotations: computes the rotations of the same ciphertext ct by every step in steps
+// SEAL does not expose its key switching decomposition so it cannot be hoisted, instead every rotation in the batch costs exactly one key switch:
+// a step with its own Galois key is rotated directly from ct, any other step is derived from an already computed rotation of the batch
+// (ct rotated by steps - 2^i, or by any step whose difference has a key) instead of letting rotate_vector decompose it into several power of two rotations
+vector<Ciphertext> Rotate_Batch(const Ciphertext &ct, const vector<int> &steps, const GaloisKeys &gal_keys, Evaluator &evaluator, MemoryPoolHandle pool = MemoryManager::GetPool())
 {
+    size_t poly_modulus_degree = ct.poly_modulus_degree();
+    int slot_count = poly_modulus_degree / 2;
 
-    int dimension = U.size();
-    int dimensionSq = pow(dimension, 2);
-    vector<vector<double>> U_transpose(dimensionSq, vector<double>(dimensionSq));
+    // Rotations computed so far, indexed by step (step 0 is ct itself and is only copied if it is requested)
+    map<int, Ciphertext> computed;
+    auto rotation = [&](int step) -> const Ciphertext & { return step == 0 ? ct : computed[step]; };
 
-    int tranposed_row = 0;
+    // Compute the smaller steps first so they can be reused by the larger ones
+    vector<int> order(steps);
+    sort(order.begin(), order.end(), [](int a, int b) { return abs(a) < abs(b); });
 
-    for (int i = 0; i < dimension; i++)
+    for (int step : order)
     {
-        // Get matrix of ones at position k
-        vector<vector<double>> one_matrix = get_matrix_of_ones(i, U);
-        print_full_matrix(one_matrix);
+        if (step == 0 || computed.count(step))
+        {
+            continue;
+        }
 
-        // Loop over matrix of ones
-        for (int offset = 0; offset < dimension; offset++)
+        // Find an already computed rotation that is one key switch away
+        int base = 0;
+        bool found = has_rotation_key(step, gal_keys, poly_modulus_degree);
+        for (int power = 1; !found && power < slot_count; power <<= 1)
         {
-            vector<double> temp_fill = pad_zero(offset * dimension, one_matrix[0]);
+            for (int sign = 1; sign >= -1; sign -= 2)
+            {
+                int candidate = step - (sign * power);
+                if ((candidate == 0 || computed.count(candidate)) && has_rotation_key(step - candidate, gal_keys, poly_modulus_degree))
+                {
+                    base = candidate;
+                    found = true;
+                    break;
+                }
+            }
+        }
+        for (auto it = computed.begin(); !found && it != computed.end(); it++)
+        {
+            if (has_rotation_key(step - it->first, gal_keys, poly_modulus_degree))
+            {
+                base = it->first;
+                found = true;
+            }
+        }
+
+        // Fall back on the decomposition done by rotate_vector when no single key switch is possible
+        computed.emplace(step, Ciphertext(pool));
+        evaluator.rotate_vector(rotation(base), step - base, gal_keys, computed[step], pool);
+    }
 
-            U_transpose[tranposed_row] = temp_fill;
-            tranposed_row++;
+    // Move every rotation out at its last use, only steps requested more than once are copied
+    map<int, int> remaining;
+    for (int step : steps)
+    {
+        remaining[step]++;
+    }
+    vector<Ciphertext> rotations(steps.size());
+    for (int i = 0; i < steps.size(); i++)
+    {
+        if (steps[i] != 0 && --remaining[steps[i]] == 0)
+        {
+            rotations[i] = move(computed[steps[i]]);
+        }
+        else
+        {
+            rotations[i] = rotation(steps[i]);
         }
     }
 
-    return U_transpose;
+    return rotations;
 }
 
-// Ciphertext dot product
-Ciphertext cipher_dot_product(Ciphertext ctA, Ciphertext ctB, int size, RelinKeys relin_keys, GaloisKeys gal_keys, Evaluator &evaluator)
+// Rotation steps a workload needs Galois keys for, filled by the Plan_* functions of the helpers it runs
+// Steps are kept in [1, slot_count): a rotation by -s uses the same key as a rotation by slot_count - s
+struct RotationPlan
 {
+    int slot_count;
+    set<int> steps;
 
-    // cout << "\nCTA Info:\n";
-    // cout << "\tLevel:\t" << context->get_context_data(ctA.parms_id())->chain_index() << endl;
-    // cout << "\tScale:\t" << log2(ctA.scale()) << endl;
-    // ios old_fmt(nullptr);
-    // old_fmt.copyfmt(cout);
-    // cout << fixed << setprecision(10);
-    // cout << "\tExact Scale:\t" << ctA.scale() << endl;
-    // cout.copyfmt(old_fmt);
-    // cout << "\tSize:\t" << ctA.size() << endl;
-
-    Ciphertext mult;
-
-    // Component-wise multiplication
-    evaluator.multiply(ctA, ctB, mult);
-
-    // cout << "\nMult Info:\n";
-    // cout << "\tLevel:\t" << context->get_context_data(mult.parms_id())->chain_index() << endl;
-    // cout << "\tScale:\t" << log2(mult.scale()) << endl;
-    // cout << "\tExact Scale:\t" << mult.scale() << endl;
-    // cout << "\tSize:\t" << mult.size() << endl;
-
-    evaluator.relinearize_inplace(mult, relin_keys);
-    evaluator.rescale_to_next_inplace(mult);
-
-    // cout << "\nMult Info:\n";
-    // cout << "\tLevel:\t" << context->get_context_data(mult.parms_id())->chain_index() << endl;
-    // cout << "\tScale:\t" << log2(mult.scale()) << endl;
-    // ios old_fmt1(nullptr);
-    // old_fmt1.copyfmt(cout);
-    // cout << fixed << setprecision(10);
-    // cout << "\tExact Scale:\t" << mult.scale() << endl;
-    // cout.copyfmt(old_fmt1);
-    // cout << "\tSize:\t" << mult.size() << endl;
-
-    // Fill with duplicate
-    Ciphertext zero_filled;
-    evaluator.rotate_vector(mult, -size, gal_keys, zero_filled); // vector has zeros now
-
-    // cout << "\nZero Filled Info:\n";
-    // cout << "\tLevel:\t" << context->get_context_data(zero_filled.parms_id())->chain_index() << endl;
-    // cout << "\tScale:\t" << log2(zero_filled.scale()) << endl;
-    // cout << "\tExact Scale:\t" << zero_filled.scale() << endl;
-    // cout << "\tSize:\t" << zero_filled.size() << endl;
-
-    Ciphertext dup;
-    evaluator.add(mult, zero_filled, dup); // vector has duplicate now
+    RotationPlan(int slot_count) : slot_count(slot_count) {}
+};
 
-    // cout << "\nDup Info:\n";
-    // cout << "\tLevel:\t" << context->get_context_data(dup.parms_id())->chain_index() << endl;
-    // cout << "\tScale:\t" << log2(dup.scale()) << endl;
-    // cout << "\tExact Scale:\t" << dup.scale() << endl;
-    // cout << "\tSize:\t" << dup.size() << endl;
-
-    for (int i = 1; i < size; i++)
+// Adds the key of a rotation by step
+void Plan_Step(RotationPlan &plan, int step)
+{
+    step = ((step % plan.slot_count) + plan.slot_count) % plan.slot_count;
+    if (step != 0)
     {
-        evaluator.rotate_vector_inplace(dup, 1, gal_keys);
-        evaluator.add_inplace(mult, dup);
+        plan.steps.insert(step);
     }
-
-    // cout << "\nMult Info:\n";
-    // cout << "\tLevel:\t" << context->get_context_data(mult.parms_id())->chain_index() << endl;
-    // cout << "\tScale:\t" << log2(mult.scale()) << endl;
-    // ios old_fmt2(nullptr);
-    // old_fmt2.copyfmt(cout);
-    // cout << fixed << setprecision(10);
-    // cout << "\tExact Scale:\t" << mult.scale() << endl;
-    // cout.copyfmt(old_fmt2);
-    // cout << "\tSize:\t" << mult.size() << endl;
-
-    // Manual Rescale
-    mult.scale() = pow(2, (int)log2(mult.scale()));
-
-    // cout << "\nMult Info:\n";
-    // cout << "\tLevel:\t" << context->get_context_data(mult.parms_id())->chain_index() << endl;
-    // cout << "\tScale:\t" << log2(mult.scale()) << endl;
-    // ios old_fmt3(nullptr);
-    // old_fmt3.copyfmt(cout);
-    // cout << fixed << setprecision(10);
-    // cout << "\tExact Scale:\t" << mult.scale() << endl;
-    // cout.copyfmt(old_fmt3);
-    // cout << "\tSize:\t" << mult.size() << endl;
-
-    return mult;
 }
 
-// Helper for Tree method, computes powers of x in a tree
-void compute_all_powers(const Ciphertext &ctx, int degree, Evaluator &evaluator, RelinKeys &relin_keys, vector<Ciphertext> &powers)
+// Checks if the plan rotates by step with a single key switch
+bool Plan_Has_Step(const RotationPlan &plan, int step)
 {
+    step = ((step % plan.slot_count) + plan.slot_count) % plan.slot_count;
+    return step == 0 || plan.steps.count(step);
+}
 
-    powers.resize(degree + 1);
-    powers[1] = ctx;
-
-    vector<int> levels(degree + 1, 0);
-    levels[1] = 0;
-    levels[0] = 0;
+// Adds the keys used by Rotate_Batch(ct, steps): follows the same search and, when no computed rotation is one key away,
+// adds the smallest power of two bridging from a computed rotation (so 1 .. n only needs the key of 1)
+// or else the difference to the nearest computed rotation (so an arithmetic progression only needs the key of its stride)
+void Plan_Batch(RotationPlan &plan, const vector<int> &steps)
+{
+    set<int> computed = {0};
+    vector<int> order(steps);
+    sort(order.begin(), order.end(), [](int a, int b) { return abs(a) < abs(b); });
 
-    for (int i = 2; i <= degree; i++)
+    for (int step : order)
     {
-        // compute x^i
-        int minlevel = i;
-        int cand = -1;
-        for (int j = 1; j <= i / 2; j++)
+        if (computed.count(step))
         {
-            int k = i - j;
-            int newlevel = max(levels[j], levels[k]) + 1;
-            if (newlevel < minlevel)
+            continue;
+        }
+
+        bool found = Plan_Has_Step(plan, step);
+        int bridge = step;
+        bool bridged = false;
+        for (int power = 1; !found && power < plan.slot_count; power <<= 1)
+        {
+            for (int sign = 1; sign >= -1; sign -= 2)
             {
-                cand = j;
-                minlevel = newlevel;
+                int candidate = step - (sign * power);
+                if (computed.count(candidate))
+                {
+                    found = Plan_Has_Step(plan, step - candidate);
+                    if (!bridged)
+                    {
+                        bridge = step - candidate;
+                        bridged = true;
+                    }
+                    if (found)
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+        for (auto it = computed.begin(); !found && it != computed.end(); it++)
+        {
+            found = Plan_Has_Step(plan, step - *it);
+            if (!bridged && abs(step - *it) < abs(bridge))
+            {
+                bridge = step - *it;
             }
         }
 
-        levels[i] = minlevel;
-        // use cand
-        if (cand < 0)
-            throw runtime_error("error");
-        // cand <= i - cand by definition
-        Ciphertext temp = powers[cand];
-        evaluator.mod_switch_to_inplace(temp, powers[i - cand].parms_id());
-
-        evaluator.multiply(temp, powers[i - cand], powers[i]);
-
-        evaluator.relinearize_inplace(powers[i], relin_keys);
-
-        evaluator.rescale_to_next_inplace(powers[i]);
+        if (!found)
+        {
+            Plan_Step(plan, bridge);
+        }
+        computed.insert(step);
     }
-
-    return;
 }
 
-// Gets a random float between a and b
-float RandomFloat(float a, float b)
+// Steps to pass to HESession (or KeyGenerator::galois_keys)
+vector<int> Plan_Galois_Steps(const RotationPlan &plan)
 {
-    float random = ((float)rand()) / (float)RAND_MAX;
-    float diff = b - a;
-    float r = random * diff;
-    return a + r;
+    return vector<int>(plan.steps.begin(), plan.steps.end());
 }
 
-// CSV to string matrix converter
-vector<vector<string>> CSVtoMatrix(string filename)
+// Runs task(i, thread, pool) for every i in [0, count) on num_threads threads, every thread allocating from its own memory pool
+// Task i always runs on thread i % num_threads, exceptions are rethrown on the calling thread
+// The tasks share the Evaluator of the HESession: it keeps no state between calls besides its context (SEAL locks the lazily built Galois
+// tables) and allocates from the pool it is given, so concurrent calls on the pools of their threads are safe
+void parallel_for(int count, int num_threads, function<void(int, int, MemoryPoolHandle &)> task)
 {
-    vector<vector<string>> result_matrix;
-
-    ifstream data(filename);
-    string line;
-    int line_count = 0;
-    while (getline(data, line))
+    num_threads = max(1, min(num_threads, count));
+    vector<exception_ptr> errors(num_threads);
+    vector<thread> threads;
+    for (int t = 0; t < num_threads; t++)
     {
-        stringstream lineStream(line);
-        string cell;
-        vector<string> parsedRow;
-        while (getline(lineStream, cell, ','))
-        {
-            parsedRow.push_back(cell);
-        }
-        // Skip first line since it has text instead of numbers
-        if (line_count != 0)
+        threads.emplace_back([&, t]() {
+            MemoryPoolHandle pool = MemoryManager::GetPool(mm_prof_opt::FORCE_NEW);
+            try
+            {
+                for (int i = t; i < count; i += num_threads)
+                {
+                    task(i, t, pool);
+                }
+            }
+            catch (...)
+            {
+                errors[t] = current_exception();
+            }
+        });
+    }
+    for (auto &th : threads)
+    {
+        th.join();
+    }
+    for (auto &error : errors)
+    {
+        if (error)
         {
-            result_matrix.push_back(parsedRow);
+            rethrow_exception(error);
         }
-        line_count++;
     }
-    return result_matrix;
 }
 
-// String matrix to float matrix converter
-vector<vector<double>> stringToDoubleMatrix(vector<vector<string>> matrix)
+// Sums ciphertexts with a pairwise tree reduction (the order of the additions only depends on cts.size())
+// cts is taken by value so callers done with their partial results can move them in
+Ciphertext add_tree(vector<Ciphertext> cts, Evaluator &evaluator)
 {
-    vector<vector<double>> result(matrix.size(), vector<double>(matrix[0].size()));
-    for (int i = 0; i < matrix.size(); i++)
+    for (int stride = 1; stride < cts.size(); stride <<= 1)
     {
-        for (int j = 0; j < matrix[0].size(); j++)
+        for (int i = 0; i + stride < cts.size(); i += 2 * stride)
+        {
+            evaluator.add_inplace(cts[i], cts[i + stride]);
+        }
+    }
+    return move(cts[0]);
+}
+
+// Sums cts[i] rotated by i * step, accumulating from the last ciphertext so every rotation is by step (one Galois key)
+Ciphertext Shift_Sum(vector<Ciphertext> cts, int step, const GaloisKeys &gal_keys, Evaluator &evaluator)
+{
+    for (int i = cts.size() - 2; i >= 0; i--)
+    {
+        evaluator.rotate_vector_inplace(cts[i + 1], step, gal_keys);
+        evaluator.add_inplace(cts[i], cts[i + 1]);
+    }
+    return move(cts[0]);
+}
+
+// Linear Transformation function between ciphertext matrix and ciphertext vector
+Ciphertext Linear_Transform_Cipher(const Ciphertext &ct, const vector<Ciphertext> &U_diagonals, const GaloisKeys &gal_keys, Evaluator &evaluator)
+{
+    // Fill ct with duplicate
+    Ciphertext ct_rot;
+    evaluator.rotate_vector(ct, -U_diagonals.size(), gal_keys, ct_rot);
+    // cout << "U_diagonals.size() = " << U_diagonals.size() << endl;
+    Ciphertext ct_new;
+    evaluator.add(ct, ct_rot, ct_new);
+
+    // Rotations of ct_new by 1 .. U_diagonals.size() - 1 in one batch
+    vector<int> steps(U_diagonals.size() - 1);
+    iota(steps.begin(), steps.end(), 1);
+    vector<Ciphertext> ct_rots = Rotate_Batch(ct_new, steps, gal_keys, evaluator);
+
+    vector<Ciphertext> ct_result(U_diagonals.size());
+    evaluator.multiply(ct_new, U_diagonals[0], ct_result[0]);
+
+    for (int l = 1; l < U_diagonals.size(); l++)
+    {
+        evaluator.multiply(ct_rots[l - 1], U_diagonals[l], ct_result[l]);
+    }
+    Ciphertext ct_prime;
+    evaluator.add_many(ct_result, ct_prime);
+
+    return ct_prime;
+}
+
+// Adds the rotations of Linear_Transform_Cipher with n diagonals
+void Plan_Linear_Transform_Cipher(RotationPlan &plan, int n)
+{
+    Plan_Step(plan, -n);
+    vector<int> steps(n - 1);
+    iota(steps.begin(), steps.end(), 1);
+    Plan_Batch(plan, steps);
+}
+
+// Linear Transformation function between plaintext  matrix and ciphertext vector
+// With num_threads > 1 the diagonals are split in contiguous blocks accumulated in parallel and the block sums are added with a tree reduction
+Ciphertext Linear_Transform_Plain(const Ciphertext &ct, const vector<Plaintext> &U_diagonals, HESession &session, int num_threads = 1)
+{
+    Evaluator &evaluator = session.evaluator;
+    GaloisKeys &gal_keys = session.gal_keys;
+
+    // Fill ct with duplicate
+    Ciphertext ct_rot;
+    evaluator.rotate_vector(ct, -U_diagonals.size(), gal_keys, ct_rot);
+    // cout << "U_diagonals.size() = " << U_diagonals.size() << endl;
+    Ciphertext ct_new;
+    evaluator.add(ct, ct_rot, ct_new);
+
+    if (num_threads > 1)
+    {
+        int n = U_diagonals.size();
+        int block_size = (n + num_threads - 1) / num_threads;
+        int num_blocks = (n + block_size - 1) / block_size;
+
+        // Every block rotates ct_new to its first diagonal once and then by 1 for each following diagonal
+        vector<Ciphertext> block_sums(num_blocks);
+        parallel_for(num_blocks, num_threads, [&](int b, int, MemoryPoolHandle &pool) {
+            int first = b * block_size;
+            int last = min(n, first + block_size);
+
+            Ciphertext temp_rot(pool);
+            evaluator.rotate_vector(ct_new, first, gal_keys, temp_rot, pool);
+            block_sums[b] = Ciphertext(pool);
+            evaluator.multiply_plain(temp_rot, U_diagonals[first], block_sums[b], pool);
+
+            Ciphertext temp_mul(pool);
+            for (int l = first + 1; l < last; l++)
+            {
+                evaluator.rotate_vector_inplace(temp_rot, 1, gal_keys, pool);
+                evaluator.multiply_plain(temp_rot, U_diagonals[l], temp_mul, pool);
+                evaluator.add_inplace(block_sums[b], temp_mul);
+            }
+        });
+
+        return add_tree(move(block_sums), evaluator);
+    }
+
+    // Rotations of ct_new by 0 .. U_diagonals.size() - 1 in one batch
+    vector<int> steps(U_diagonals.size());
+    iota(steps.begin(), steps.end(), 0);
+    vector<Ciphertext> ct_result = Rotate_Batch(ct_new, steps, gal_keys, evaluator);
+
+    for (int l = 0; l < U_diagonals.size(); l++)
+    {
+        evaluator.multiply_plain_inplace(ct_result[l], U_diagonals[l]);
+    }
+    Ciphertext ct_prime;
+    evaluator.add_many(ct_result, ct_prime);
+
+    return ct_prime;
+}
+
+// Adds the rotations of Linear_Transform_Plain with n diagonals on num_threads threads
+void Plan_Linear_Transform_Plain(RotationPlan &plan, int n, int num_threads = 1)
+{
+    Plan_Step(plan, -n);
+    if (num_threads > 1)
+    {
+        int block_size = (n + num_threads - 1) / num_threads;
+        for (int first = block_size; first < n; first += block_size)
+        {
+            Plan_Step(plan, first);
+        }
+        Plan_Step(plan, 1);
+        return;
+    }
+
+    vector<int> steps(n);
+    iota(steps.begin(), steps.end(), 0);
+    Plan_Batch(plan, steps);
+}
+
+// Encoded non-zero diagonals of a sparse matrix: (rotation index l, diagonal l) pairs
+struct SparsePlainDiagonals
+{
+    int size;
+    vector<pair<int, Plaintext>> diagonals;
+};
+
+// Encodes the non-zero diagonals of a sparse matrix for Linear_Transform_Plain_Sparse (offline step)
+SparsePlainDiagonals Encode_Sparse_Diagonals(const SparseDiagonals &U, double scale, CKKSEncoder &ckks_encoder)
+{
+    SparsePlainDiagonals encoded{U.size, {}};
+    for (auto &diagonal_entry : U.diagonals)
+    {
+        Plaintext diagonal_plain;
+        ckks_encoder.encode(diagonal_entry.second, scale, diagonal_plain);
+        encoded.diagonals.emplace_back(diagonal_entry.first, move(diagonal_plain));
+    }
+
+    return encoded;
+}
+
+// Linear Transformation function between a sparse plaintext matrix and ciphertext vector
+// Only the non-zero diagonals are evaluated: one rotation and one multiplication per diagonal (2 * dimension - 1 for a transpose instead of dimension^2)
+Ciphertext Linear_Transform_Plain_Sparse(const Ciphertext &ct, const SparsePlainDiagonals &U, HESession &session, MemoryPoolHandle pool = MemoryManager::GetPool())
+{
+    Evaluator &evaluator = session.evaluator;
+    GaloisKeys &gal_keys = session.gal_keys;
+
+    // Fill ct with duplicate
+    Ciphertext ct_rot(pool);
+    evaluator.rotate_vector(ct, -U.size, gal_keys, ct_rot, pool);
+    Ciphertext ct_new(pool);
+    evaluator.add(ct, ct_rot, ct_new);
+
+    // Rotations of ct_new by the index of every non-zero diagonal in one batch
+    vector<int> steps;
+    for (auto &diagonal : U.diagonals)
+    {
+        steps.push_back(diagonal.first);
+    }
+    vector<Ciphertext> ct_result = Rotate_Batch(ct_new, steps, gal_keys, evaluator, pool);
+
+    for (int i = 0; i < steps.size(); i++)
+    {
+        evaluator.multiply_plain_inplace(ct_result[i], U.diagonals[i].second, pool);
+    }
+    Ciphertext ct_prime(pool);
+    evaluator.add_many(ct_result, ct_prime);
+
+    return ct_prime;
+}
+
+// Levels of Linear_Transform_Plain_Sparse: the products with the diagonals, left at scale^2 without a rescale
+int Linear_Transform_Plain_Sparse_Depth()
+{
+    return 1;
+}
+
+// Adds the rotations of Linear_Transform_Plain_Sparse with the non-zero diagonals of U
+void Plan_Linear_Transform_Plain_Sparse(RotationPlan &plan, const SparseDiagonals &U)
+{
+    Plan_Step(plan, -U.size);
+    vector<int> steps;
+    for (auto &diagonal : U.diagonals)
+    {
+        steps.push_back(diagonal.first);
+    }
+    Plan_Batch(plan, steps);
+}
+
+// Number of baby steps used by the baby-step giant-step (BSGS) linear transformation of a matrix with n diagonals
+int BSGS_Baby_Steps(int n)
+{
+    return ceil(sqrt(n));
+}
+
+// Rotates a vector of slots by steps (same direction as Evaluator::rotate_vector)
+template <typename T>
+vector<T> rotate_slots(const vector<T> &slots, int steps)
+{
+    int slot_count = slots.size();
+    vector<T> rotated(slot_count);
+    for (int i = 0; i < slot_count; i++)
+    {
+        rotated[i] = slots[(((i + steps) % slot_count) + slot_count) % slot_count];
+    }
+
+    return rotated;
+}
+
+// Exact scale management: a rescale divides the scale by the last prime of the level, which is only close to a power of two,
+// so instead of overwriting scales the plaintext constants are encoded at the scale that makes the rescaled result land on the wanted scale
+
+// Scale of the last prime of parms_id: a ciphertext multiplied by a plaintext encoded at this scale and rescaled keeps its exact scale
+double Prime_Scale(const shared_ptr<SEALContext> &context, parms_id_type parms_id)
+{
+    return (double)context->get_context_data(parms_id)->parms().coeff_modulus().back().value();
+}
+
+// parms_id of the level below parms_id (after one rescale)
+parms_id_type Next_Parms_Id(const shared_ptr<SEALContext> &context, parms_id_type parms_id)
+{
+    return context->get_context_data(parms_id)->next_context_data()->parms_id();
+}
+
+// parms_id of the level at chain_index
+parms_id_type Chain_Parms_Id(const shared_ptr<SEALContext> &context, int chain_index)
+{
+    auto context_data = context->first_context_data();
+    while (context_data->chain_index() > chain_index)
+    {
+        context_data = context_data->next_context_data();
+    }
+    return context_data->parms_id();
+}
+
+int Chain_Index(const shared_ptr<SEALContext> &context, const Ciphertext &ct)
+{
+    return context->get_context_data(ct.parms_id())->chain_index();
+}
+
+// Scale to encode a plaintext at so that a ciphertext at (parms_id, scale) multiplied by it and rescaled is exactly at target_scale
+// (also the scale a ciphertext factor must have for a product with a ciphertext at scale to rescale to target_scale)
+double Target_Plain_Scale(const shared_ptr<SEALContext> &context, parms_id_type parms_id, double scale, double target_scale)
+{
+    double prime = Prime_Scale(context, parms_id);
+    double plain_scale = target_scale * prime / scale;
+    // The evaluator computes scale * plain_scale / prime, the rounding can leave it a few ulps off: nudge plain_scale until it is exact
+    for (int i = 0; i < 8 && scale * plain_scale / prime != target_scale; i++)
+    {
+        plain_scale = nextafter(plain_scale, scale * plain_scale / prime < target_scale ? HUGE_VAL : 0);
+    }
+    return plain_scale;
+}
+
+double Target_Plain_Scale(const shared_ptr<SEALContext> &context, const Ciphertext &ct, double target_scale)
+{
+    return Target_Plain_Scale(context, ct.parms_id(), ct.scale(), target_scale);
+}
+
+// Multiplies ct by value encoded at the level and scale of Target_Plain_Scale and rescales, ct is then exactly at target_scale
+void Multiply_Const_Rescale_inplace(Ciphertext &ct, double value, double target_scale, HESession &session, MemoryPoolHandle pool = MemoryManager::GetPool())
+{
+    Plaintext value_pt(pool);
+    session.ckks_encoder.encode(value, ct.parms_id(), Target_Plain_Scale(session.context, ct, target_scale), value_pt, pool);
+    session.evaluator.multiply_plain_inplace(ct, value_pt, pool);
+    session.evaluator.rescale_to_next_inplace(ct, pool);
+}
+
+// Adds value to ct, encoded at the exact level and scale of ct
+void Add_Const_inplace(Ciphertext &ct, double value, HESession &session)
+{
+    if (value == 0)
+    {
+        return;
+    }
+    Plaintext value_pt;
+    session.ckks_encoder.encode(value, ct.parms_id(), ct.scale(), value_pt);
+    session.evaluator.add_plain_inplace(ct, value_pt);
+}
+
+// Mod switches the higher of a and b to the level of the other one
+void Match_Levels_inplace(Ciphertext &a, Ciphertext &b, HESession &session)
+{
+    if (Chain_Index(session.context, a) > Chain_Index(session.context, b))
+    {
+        session.evaluator.mod_switch_to_inplace(a, b.parms_id());
+    }
+    else
+    {
+        session.evaluator.mod_switch_to_inplace(b, a.parms_id());
+    }
+}
+
+// Encodes the diagonals of a matrix pre-rotated for the BSGS linear transformation (offline step)
+// Diagonal l = baby_steps * j + i is rotated by -(baby_steps * j) so the giant step rotation can be done after the inner sum
+vector<Plaintext> BSGS_Encode_Diagonals(const vector<vector<double>> &U_diagonals, double scale, CKKSEncoder &ckks_encoder)
+{
+    int n = U_diagonals.size();
+    int baby_steps = BSGS_Baby_Steps(n);
+    vector<Plaintext> rotated_diagonals(n);
+
+    for (int l = 0; l < n; l++)
+    {
+        int giant_step = (l / baby_steps) * baby_steps;
+
+        // Pad the diagonal to the full slot count so the rotation wraps around the whole vector
+        vector<double> diagonal(ckks_encoder.slot_count(), 0);
+        for (int i = 0; i < U_diagonals[l].size(); i++)
+        {
+            diagonal[i] = U_diagonals[l][i];
+        }
+
+        ckks_encoder.encode(rotate_slots(diagonal, -giant_step), scale, rotated_diagonals[l]);
+    }
+
+    return rotated_diagonals;
+}
+
+// Same as above for a sparse matrix: only the non-zero diagonals are encoded, the other plaintexts are left empty (skipped by Linear_Transform_Plain_BSGS)
+// With batch > 1 every diagonal is repeated every 2 * size slots, to transform batch vectors laid out side by side (see CC_Batch_Stride)
+vector<Plaintext> BSGS_Encode_Diagonals(const SparseDiagonals &U, parms_id_type parms_id, double scale, CKKSEncoder &ckks_encoder, int batch = 1)
+{
+    int baby_steps = BSGS_Baby_Steps(U.size);
+    vector<Plaintext> rotated_diagonals(U.size);
+
+    for (auto &diagonal_entry : U.diagonals)
+    {
+        int l = diagonal_entry.first;
+        int giant_step = (l / baby_steps) * baby_steps;
+
+        vector<double> diagonal(ckks_encoder.slot_count(), 0);
+        for (int b = 0; b < batch; b++)
+        {
+            copy(diagonal_entry.second.begin(), diagonal_entry.second.end(), diagonal.begin() + b * 2 * U.size);
+        }
+
+        ckks_encoder.encode(rotate_slots(diagonal, -giant_step), parms_id, scale, rotated_diagonals[l]);
+    }
+
+    return rotated_diagonals;
+}
+
+// Pre-rotates already encoded diagonals for the BSGS linear transformation (offline step)
+// Zero diagonals (empty plaintexts) are kept as they are, Linear_Transform_Plain_BSGS skips them
+vector<Plaintext> BSGS_Rotate_Diagonals(const vector<Plaintext> &U_diagonals, CKKSEncoder &ckks_encoder)
+{
+    int n = U_diagonals.size();
+    int baby_steps = BSGS_Baby_Steps(n);
+    vector<Plaintext> rotated_diagonals(n);
+
+    for (int l = 0; l < n; l++)
+    {
+        int giant_step = (l / baby_steps) * baby_steps;
+        if (giant_step == 0 || U_diagonals[l].is_zero())
+        {
+            rotated_diagonals[l] = U_diagonals[l];
+            continue;
+        }
+
+        vector<double> diagonal;
+        ckks_encoder.decode(U_diagonals[l], diagonal);
+        ckks_encoder.encode(rotate_slots(diagonal, -giant_step), U_diagonals[l].parms_id(), U_diagonals[l].scale(), rotated_diagonals[l]);
+    }
+
+    return rotated_diagonals;
+}
+
+// BSGS Linear Transformation function between plaintext matrix and ciphertext vector
+// U_diagonals must be pre-rotated with BSGS_Encode_Diagonals or BSGS_Rotate_Diagonals
+// Uses about 2 * sqrt(n) rotations instead of n, the giant steps are accumulated from the last one (Horner) so they all rotate by baby_steps
+// Zero diagonals (empty plaintexts of a sparse matrix) are skipped, as are the baby steps and giant steps that only meet zero diagonals
+Ciphertext Linear_Transform_Plain_BSGS(const Ciphertext &ct, const vector<Plaintext> &U_diagonals, HESession &session, MemoryPoolHandle pool = MemoryManager::GetPool())
+{
+    Evaluator &evaluator = session.evaluator;
+    GaloisKeys &gal_keys = session.gal_keys;
+
+    int n = U_diagonals.size();
+    int baby_steps = BSGS_Baby_Steps(n);
+    int giant_steps = (n + baby_steps - 1) / baby_steps;
+
+    vector<bool> non_zero(n);
+    int last_baby_step = 0;
+    for (int l = 0; l < n; l++)
+    {
+        non_zero[l] = !U_diagonals[l].is_zero();
+        if (non_zero[l])
+        {
+            last_baby_step = max(last_baby_step, l % baby_steps);
+        }
+    }
+
+    // Fill ct with duplicate
+    Ciphertext ct_rot(pool);
+    evaluator.rotate_vector(ct, -n, gal_keys, ct_rot, pool);
+    Ciphertext ct_new(pool);
+    evaluator.add(ct, ct_rot, ct_new);
+
+    // Baby steps: rotations of ct_new by 0 .. last_baby_step (at most baby_steps - 1)
+    vector<int> baby(last_baby_step + 1);
+    iota(baby.begin(), baby.end(), 0);
+    vector<Ciphertext> ct_baby = Rotate_Batch(ct_new, baby, gal_keys, evaluator, pool);
+
+    // Giant steps: ct_prime = (((inner_{G-1} >> g) + inner_{G-2}) >> g + ...) + inner_0 with inner_j the sum over the baby steps
+    Ciphertext ct_prime(pool);
+    bool started = false;
+    for (int j = giant_steps - 1; j >= 0; j--)
+    {
+        vector<Ciphertext> ct_inner;
+        for (int i = 0; i < baby_steps && (j * baby_steps) + i < n; i++)
+        {
+            if (!non_zero[(j * baby_steps) + i])
+            {
+                continue;
+            }
+            Ciphertext temp_mul(pool);
+            evaluator.multiply_plain(ct_baby[i], U_diagonals[(j * baby_steps) + i], temp_mul, pool);
+            ct_inner.push_back(move(temp_mul));
+        }
+
+        if (started)
+        {
+            evaluator.rotate_vector_inplace(ct_prime, baby_steps, gal_keys, pool);
+        }
+        if (ct_inner.empty())
+        {
+            continue;
+        }
+
+        Ciphertext inner(pool);
+        evaluator.add_many(ct_inner, inner);
+        if (started)
+        {
+            evaluator.add_inplace(ct_prime, inner);
+        }
+        else
+        {
+            ct_prime = move(inner);
+            started = true;
+        }
+    }
+
+    return ct_prime;
+}
+
+// Adds the rotations of Linear_Transform_Plain_BSGS and Linear_Transform_Cipher_BSGS with n diagonals: -n, 1 and baby_steps
+void Plan_Linear_Transform_BSGS(RotationPlan &plan, int n)
+{
+    int baby_steps = BSGS_Baby_Steps(n);
+    Plan_Step(plan, -n);
+    vector<int> baby(baby_steps);
+    iota(baby.begin(), baby.end(), 0);
+    Plan_Batch(plan, baby);
+    if (baby_steps < n)
+    {
+        Plan_Step(plan, baby_steps);
+    }
+}
+
+// Pre-rotates encrypted diagonals for the BSGS linear transformation (offline step)
+vector<Ciphertext> BSGS_Rotate_Diagonals(const vector<Ciphertext> &U_diagonals, const GaloisKeys &gal_keys, Evaluator &evaluator)
+{
+    int n = U_diagonals.size();
+    int baby_steps = BSGS_Baby_Steps(n);
+    vector<Ciphertext> rotated_diagonals(n);
+
+    for (int l = 0; l < n; l++)
+    {
+        int giant_step = (l / baby_steps) * baby_steps;
+        if (giant_step == 0)
+        {
+            rotated_diagonals[l] = U_diagonals[l];
+        }
+        else
+        {
+            evaluator.rotate_vector(U_diagonals[l], -giant_step, gal_keys, rotated_diagonals[l]);
+        }
+    }
+
+    return rotated_diagonals;
+}
+
+// Adds the rotations of BSGS_Rotate_Diagonals of n encrypted diagonals
+void Plan_BSGS_Rotate_Diagonals(RotationPlan &plan, int n)
+{
+    int baby_steps = BSGS_Baby_Steps(n);
+    for (int giant_step = baby_steps; giant_step < n; giant_step += baby_steps)
+    {
+        Plan_Step(plan, -giant_step);
+    }
+}
+
+// BSGS Linear Transformation function between ciphertext matrix and ciphertext vector
+// U_diagonals must be pre-rotated with BSGS_Rotate_Diagonals
+// The inner sums are relinearized before the giant step rotations
+Ciphertext Linear_Transform_Cipher_BSGS(const Ciphertext &ct, const vector<Ciphertext> &U_diagonals, const GaloisKeys &gal_keys, const RelinKeys &relin_keys, Evaluator &evaluator)
+{
+    int n = U_diagonals.size();
+    int baby_steps = BSGS_Baby_Steps(n);
+    int giant_steps = (n + baby_steps - 1) / baby_steps;
+
+    // Fill ct with duplicate
+    Ciphertext ct_rot;
+    evaluator.rotate_vector(ct, -n, gal_keys, ct_rot);
+    Ciphertext ct_new;
+    evaluator.add(ct, ct_rot, ct_new);
+
+    // Baby steps: rotations of ct_new by 0 .. baby_steps - 1
+    vector<int> baby(baby_steps);
+    iota(baby.begin(), baby.end(), 0);
+    vector<Ciphertext> ct_baby = Rotate_Batch(ct_new, baby, gal_keys, evaluator);
+
+    // Giant steps accumulated from the last one as in Linear_Transform_Plain_BSGS
+    Ciphertext ct_prime;
+    for (int j = giant_steps - 1; j >= 0; j--)
+    {
+        vector<Ciphertext> ct_inner;
+        for (int i = 0; i < baby_steps && (j * baby_steps) + i < n; i++)
+        {
+            Ciphertext temp_mul;
+            evaluator.multiply(ct_baby[i], U_diagonals[(j * baby_steps) + i], temp_mul);
+            ct_inner.push_back(move(temp_mul));
+        }
+        Ciphertext inner;
+        evaluator.add_many(ct_inner, inner);
+        evaluator.relinearize_inplace(inner, relin_keys);
+
+        if (j == giant_steps - 1)
+        {
+            ct_prime = move(inner);
+        }
+        else
+        {
+            evaluator.rotate_vector_inplace(ct_prime, baby_steps, gal_keys);
+            evaluator.add_inplace(ct_prime, inner);
+        }
+    }
+
+    return ct_prime;
+}
+
+// Ciphertext-Ciphertext matrix multiplication of two matrix encoded dimension x dimension matrices at the first level
+// U_sigma, U_tau, V_k and W_k diagonals must be pre-rotated for the BSGS linear transformation and encoded with CC_Diagonal_Parms
+// (every transformation is rescaled by the prime its diagonals are scaled by, so all scales stay exact and no scale is overwritten)
+// The d products are accumulated in size 3, then relinearized and rescaled once: the result is at scale^2 / q three levels down
+// The d - 1 independent pairs of transformations of Step 2 run on num_threads threads
+Ciphertext CC_Matrix_Multiplication(const Ciphertext &ctA, const Ciphertext &ctB, int dimension, const vector<Plaintext> &U_sigma_diagonals, const vector<Plaintext> &U_tau_diagonals, const vector<vector<Plaintext>> &V_diagonals, const vector<vector<Plaintext>> &W_diagonals, HESession &session, int num_threads = 1)
+{
+    Evaluator &evaluator = session.evaluator;
+
+    vector<Ciphertext> ctA_result(dimension);
+    vector<Ciphertext> ctB_result(dimension);
+
+    cout << "----------Step 1----------- " << endl;
+    // Step 1-1
+    ctA_result[0] = Linear_Transform_Plain_BSGS(ctA, U_sigma_diagonals, session);
+    evaluator.rescale_to_next_inplace(ctA_result[0]);
+
+    // Step 1-2
+    ctB_result[0] = Linear_Transform_Plain_BSGS(ctB, U_tau_diagonals, session);
+    evaluator.rescale_to_next_inplace(ctB_result[0]);
+
+    // Step 2
+    cout << "----------Step 2----------- " << endl;
+
+    cout << "Linear Transf at k = 1 .. " << dimension - 1 << " on " << num_threads << " threads";
+    parallel_for(dimension - 1, num_threads, [&](int i, int, MemoryPoolHandle &pool) {
+        int k = i + 1;
+        ctA_result[k] = Linear_Transform_Plain_BSGS(ctA_result[0], V_diagonals[k - 1], session, pool);
+        evaluator.rescale_to_next_inplace(ctA_result[k], pool);
+        ctB_result[k] = Linear_Transform_Plain_BSGS(ctB_result[0], W_diagonals[k - 1], session, pool);
+        evaluator.rescale_to_next_inplace(ctB_result[k], pool);
+    });
+    cout << "..... Done" << endl;
+
+    // Step 3
+    cout << "----------Step 3----------- " << endl;
+
+    // Bring the Step 1 results to the level of the Step 2 results (same exact scale)
+    evaluator.mod_switch_to_next_inplace(ctA_result[0]);
+    evaluator.mod_switch_to_next_inplace(ctB_result[0]);
+
+    // Lazy relinearization: the tensor products are added in size 3
+    Ciphertext ctAB;
+    evaluator.multiply(ctA_result[0], ctB_result[0], ctAB);
+    for (int k = 1; k < dimension; k++)
+    {
+        Ciphertext temp_mul;
+        evaluator.multiply(ctA_result[k], ctB_result[k], temp_mul);
+        evaluator.add_inplace(ctAB, temp_mul);
+    }
+    evaluator.relinearize_inplace(ctAB, session.relin_keys);
+    evaluator.rescale_to_next_inplace(ctAB);
+
+    return ctAB;
+}
+
+// Level and scale of the diagonals of CC_Matrix_Multiplication: U_sigma and U_tau (step 1) at the first level, V_k and W_k (step 2) at the next one,
+// both scaled by the last prime of their level
+pair<parms_id_type, double> CC_Diagonal_Parms(const shared_ptr<SEALContext> &context, int step)
+{
+    auto context_data = context->first_context_data();
+    if (step == 2)
+    {
+        context_data = context_data->next_context_data();
+    }
+    return {context_data->parms_id(), Prime_Scale(context, context_data->parms_id())};
+}
+
+// Levels of CC_Matrix_Multiplication: the transformations of Step 1, those of Step 2 and the products of Step 3
+int CC_Matrix_Multiplication_Depth()
+{
+    return 3;
+}
+
+// Adds the rotations of CC_Matrix_Multiplication of dimension x dimension matrices (every transformation has dimension^2 diagonals)
+void Plan_CC_Matrix_Multiplication(RotationPlan &plan, int dimension)
+{
+    Plan_Linear_Transform_BSGS(plan, dimension * dimension);
+}
+
+// Batched matrix multiplication: CC_Matrix_Multiplication multiplies several independent pairs at once when they are laid out side by side,
+// matrix b in slots [b * stride, b * stride + dimension^2) with stride = 2 * dimension^2 (the linear transformations duplicate each matrix
+// into the free half of its block, so blocks never read each other) and the diagonals are encoded with the same batch
+int CC_Batch_Stride(int dimension)
+{
+    return 2 * dimension * dimension;
+}
+
+// Number of pairs one CC_Matrix_Multiplication call can multiply
+int CC_Batch_Capacity(int dimension, int slot_count)
+{
+    return slot_count / CC_Batch_Stride(dimension);
+}
+
+// Rows of the batched layout: row i holds row i of every matrix at its block offset (C_Matrix_Encode then places the rows as usual)
+vector<vector<double>> Batch_Matrix_Rows(const vector<vector<vector<double>>> &matrices, int slot_count)
+{
+    int batch = matrices.size();
+    int dimension = matrices[0].size();
+    int stride = CC_Batch_Stride(dimension);
+    if (batch > CC_Batch_Capacity(dimension, slot_count))
+    {
+        cerr << "Too many matrices for the batch: " << batch << ". Choose at most " << CC_Batch_Capacity(dimension, slot_count) << endl;
+        exit(1);
+    }
+
+    vector<vector<double>> rows(dimension, vector<double>(slot_count, 0));
+    for (int b = 0; b < batch; b++)
+    {
+        for (int i = 0; i < dimension; i++)
+        {
+            copy(matrices[b][i].begin(), matrices[b][i].end(), rows[i].begin() + b * stride);
+        }
+    }
+
+    return rows;
+}
+
+// Reads the batch matrices of a decoded CC_Matrix_Multiplication result
+vector<vector<vector<double>>> Unbatch_Matrices(const vector<double> &slots, int dimension, int batch)
+{
+    int stride = CC_Batch_Stride(dimension);
+    vector<vector<vector<double>>> matrices(batch, vector<vector<double>>(dimension, vector<double>(dimension)));
+    for (int b = 0; b < batch; b++)
+    {
+        for (int i = 0; i < dimension; i++)
+        {
+            for (int j = 0; j < dimension; j++)
+            {
+                matrices[b][i][j] = slots[b * stride + i * dimension + j];
+            }
+        }
+    }
+
+    return matrices;
+}
+
+// Diagonal bank: the BSGS encoded U_sigma, U_tau, V_k and W_k diagonals of CC_Matrix_Multiplication saved once per (dimension, batch, parms_id, scale),
+// then memory mapped and only deserialized when a matrix is first used, so the constants are never encoded again
+// File layout: DiagonalBankHeader, the serialized plaintexts of the non-zero diagonals, then the entry_count DiagonalBankEntry of the index
+const char DIAGONAL_BANK_MAGIC[8] = {'D', 'I', 'A', 'G', 'B', 'A', 'N', 'K'};
+const uint32_t DIAGONAL_BANK_VERSION = 3;
+
+enum BankMatrix
+{
+    BANK_U_SIGMA = 0,
+    BANK_U_TAU = 1,
+    BANK_V_K = 2,
+    BANK_W_K = 3
+};
+
+struct DiagonalBankHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t dimension;
+    uint32_t batch;
+    uint32_t reserved;
+    parms_id_type parms_id;
+    double scale;
+    uint64_t entry_count;
+    uint64_t index_offset;
+};
+
+// Serialized diagonal l of a matrix (k is 0 for U_sigma and U_tau)
+struct DiagonalBankEntry
+{
+    uint32_t matrix;
+    uint32_t k;
+    uint32_t diagonal;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct DiagonalBank
+{
+    int dimension;
+    int batch;
+    shared_ptr<SEALContext> context;
+
+    // Mapped bank file and its entries by matrix
+    const SEAL_BYTE *data = nullptr;
+    size_t data_size = 0;
+    vector<vector<DiagonalBankEntry>> index;
+
+    // Deserialized diagonals by matrix: one vector of dimension^2 plaintexts (zero diagonals are empty) for U_sigma and U_tau,
+    // dimension - 1 of them (k = 1 .. dimension - 1) for V_k and W_k
+    vector<vector<vector<Plaintext>>> diagonals;
+    vector<bool> loaded;
+    mutex diagonals_mutex;
+
+    DiagonalBank(int dimension, int batch, shared_ptr<SEALContext> context)
+        : dimension(dimension), batch(batch), context(context), index(4), diagonals(4), loaded(4, false) {}
+    DiagonalBank(const DiagonalBank &) = delete;
+    DiagonalBank &operator=(const DiagonalBank &) = delete;
+
+    ~DiagonalBank()
+    {
+        if (data)
+        {
+            munmap((void *)data, data_size);
+        }
+    }
+};
+
+// Path of the bank file of (dimension, batch, parms_id, scale) in directory (the full key is also checked against the file header)
+string Diagonal_Bank_Path(const string &directory, int dimension, int batch, parms_id_type parms_id, double scale)
+{
+    stringstream path;
+    path << directory << "/diagonals_d" << dimension << "_b" << batch << "_s" << (int)log2(scale) << "_" << hex << parms_id[0] << ".bank";
+    return path.str();
+}
+
+// Number of non-zero diagonals of the permutations of CC_Matrix_Multiplication: (2d - 1) for U_sigma, d for U_tau, 2 per V_k and 1 per W_k
+// (the batch layout repeats every diagonal in place, so it does not change the count)
+uint64_t Diagonal_Bank_Entry_Count(int dimension)
+{
+    uint64_t count = get_permutation_diagonals(get_U_sigma_permutation(dimension)).diagonals.size() +
+                     get_permutation_diagonals(get_U_tau_permutation(dimension)).diagonals.size();
+    for (int k = 1; k < dimension; k++)
+    {
+        count += get_permutation_diagonals(get_V_k_permutation(dimension, k)).diagonals.size() +
+                 get_permutation_diagonals(get_W_k_permutation(dimension, k)).diagonals.size();
+    }
+    return count;
+}
+
+// Encodes the diagonals of every permutation of CC_Matrix_Multiplication and saves them to path (one matrix in memory at a time)
+// The bank is written to a temporary file in the same directory and renamed into place, so a reader never maps a partial bank
+void Save_Diagonal_Bank(const string &path, int dimension, int batch, HESession &session)
+{
+    string temp_path = path + ".tmp" + to_string(getpid());
+    ofstream file(temp_path, ios::binary | ios::trunc);
+    if (!file)
+    {
+        cerr << "Couldn't open file: " << temp_path << endl;
+        exit(1);
+    }
+
+    DiagonalBankHeader header{};
+    memcpy(header.magic, DIAGONAL_BANK_MAGIC, sizeof(header.magic));
+    header.version = DIAGONAL_BANK_VERSION;
+    header.dimension = dimension;
+    header.batch = batch;
+    header.parms_id = session.context->first_parms_id();
+    header.scale = session.scale;
+    file.write((const char *)&header, sizeof(header));
+
+    vector<DiagonalBankEntry> entries;
+    auto save_matrix = [&](uint32_t matrix, uint32_t k, const vector<int> &permutation) {
+        pair<parms_id_type, double> parms = CC_Diagonal_Parms(session.context, matrix == BANK_V_K || matrix == BANK_W_K ? 2 : 1);
+        vector<Plaintext> matrix_diagonals = BSGS_Encode_Diagonals(get_permutation_diagonals(permutation), parms.first, parms.second, session.ckks_encoder, batch);
+        for (uint32_t l = 0; l < matrix_diagonals.size(); l++)
+        {
+            if (matrix_diagonals[l].is_zero())
+            {
+                continue;
+            }
+            DiagonalBankEntry entry{matrix, k, l, 0, (uint64_t)file.tellp(), 0};
+            entry.size = matrix_diagonals[l].save(file, compr_mode_type::none);
+            entries.push_back(entry);
+        }
+    };
+
+    save_matrix(BANK_U_SIGMA, 0, get_U_sigma_permutation(dimension));
+    save_matrix(BANK_U_TAU, 0, get_U_tau_permutation(dimension));
+    for (int k = 1; k < dimension; k++)
+    {
+        save_matrix(BANK_V_K, k, get_V_k_permutation(dimension, k));
+        save_matrix(BANK_W_K, k, get_W_k_permutation(dimension, k));
+    }
+
+    header.entry_count = entries.size();
+    header.index_offset = file.tellp();
+    file.write((const char *)entries.data(), entries.size() * sizeof(DiagonalBankEntry));
+    file.seekp(0);
+    file.write((const char *)&header, sizeof(header));
+    file.close();
+
+    if (!file || rename(temp_path.c_str(), path.c_str()) != 0)
+    {
+        cerr << "Couldn't write file: " << path << endl;
+        remove(temp_path.c_str());
+        exit(1);
+    }
+}
+
+// Maps the bank file at path, returns false if it is missing, truncated, incomplete or saved for another (dimension, batch, parms_id, scale)
+bool Map_Diagonal_Bank(DiagonalBank &bank, const string &path, parms_id_type parms_id, double scale)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size < (off_t)sizeof(DiagonalBankHeader))
+    {
+        close(fd);
+        return false;
+    }
+    size_t size = file_stat.st_size;
+    void *mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+    {
+        return false;
+    }
+
+    const DiagonalBankHeader *header = (const DiagonalBankHeader *)mapped;
+    bool valid = memcmp(header->magic, DIAGONAL_BANK_MAGIC, sizeof(header->magic)) == 0 && header->version == DIAGONAL_BANK_VERSION &&
+                 header->dimension == bank.dimension && header->batch == bank.batch && header->parms_id == parms_id && header->scale == scale &&
+                 header->index_offset <= size && header->entry_count <= (size - header->index_offset) / sizeof(DiagonalBankEntry) &&
+                 header->entry_count == Diagonal_Bank_Entry_Count(bank.dimension);
+    if (!valid)
+    {
+        munmap(mapped, size);
+        return false;
+    }
+
+    const DiagonalBankEntry *entries = (const DiagonalBankEntry *)((const char *)mapped + header->index_offset);
+    for (uint64_t i = 0; i < header->entry_count; i++)
+    {
+        const DiagonalBankEntry &entry = entries[i];
+        bool per_k = entry.matrix == BANK_V_K || entry.matrix == BANK_W_K;
+        bool in_range = entry.matrix <= BANK_W_K && entry.diagonal < bank.dimension * bank.dimension && (per_k ? entry.k >= 1 && entry.k < bank.dimension : entry.k == 0);
+        if (!in_range || entry.offset + entry.size > header->index_offset)
+        {
+            munmap(mapped, size);
+            return false;
+        }
+        bank.index[entry.matrix].push_back(entry);
+    }
+
+    bank.data = (const SEAL_BYTE *)mapped;
+    bank.data_size = size;
+    return true;
+}
+
+// Opens the diagonal bank of (dimension, batch, first parms_id, scale) of the session in directory, saving it first if it is missing or stale
+unique_ptr<DiagonalBank> Open_Diagonal_Bank(const string &directory, int dimension, HESession &session, int batch = 1)
+{
+    parms_id_type parms_id = session.context->first_parms_id();
+    string path = Diagonal_Bank_Path(directory, dimension, batch, parms_id, session.scale);
+
+    unique_ptr<DiagonalBank> bank(new DiagonalBank(dimension, batch, session.context));
+    if (!Map_Diagonal_Bank(*bank, path, parms_id, session.scale))
+    {
+        Save_Diagonal_Bank(path, dimension, batch, session);
+        bank.reset(new DiagonalBank(dimension, batch, session.context));
+        if (!Map_Diagonal_Bank(*bank, path, parms_id, session.scale))
+        {
+            cerr << "Couldn't map diagonal bank: " << path << endl;
+            exit(1);
+        }
+    }
+
+    return bank;
+}
+
+// Gets the diagonals of a bank matrix (BankMatrix), deserializing them from the mapped file on first use
+const vector<vector<Plaintext>> &Get_Bank_Diagonals(DiagonalBank &bank, int matrix)
+{
+    lock_guard<mutex> lock(bank.diagonals_mutex);
+    if (!bank.loaded[matrix])
+    {
+        bool per_k = matrix == BANK_V_K || matrix == BANK_W_K;
+        bank.diagonals[matrix].assign(per_k ? bank.dimension - 1 : 1, vector<Plaintext>(bank.dimension * bank.dimension));
+        for (auto &entry : bank.index[matrix])
+        {
+            Plaintext &diagonal = bank.diagonals[matrix][per_k ? entry.k - 1 : 0][entry.diagonal];
+            diagonal.load(bank.context, bank.data + entry.offset, entry.size);
+        }
+        bank.loaded[matrix] = true;
+    }
+
+    return bank.diagonals[matrix];
+}
+
+// Linear transformation function between ciphertext matrix and plaintext vector
+Ciphertext Linear_Transform_CipherMatrix_PlainVector(const vector<Plaintext> &pt_rotations, const vector<Ciphertext> &U_diagonals, const GaloisKeys &gal_keys, Evaluator &evaluator)
+{
+    vector<Ciphertext> ct_result(pt_rotations.size());
+
+    for (int i = 0; i < pt_rotations.size(); i++)
+    {
+        evaluator.multiply_plain(U_diagonals[i], pt_rotations[i], ct_result[i]);
+    }
+
+    Ciphertext ct_prime;
+    evaluator.add_many(ct_result, ct_prime);
+
+    return ct_prime;
+}
+
+// Encodes Ciphertext Matrix into a single vector (Row ordering of a matix), row i is moved to slot i * dimension
+Ciphertext C_Matrix_Encode(const vector<Ciphertext> &matrix, const GaloisKeys &gal_keys, Evaluator &evaluator)
+{
+    int dimension = matrix.size();
+    return Shift_Sum(matrix, -dimension, gal_keys, evaluator);
+}
+
+// Adds the rotations of C_Matrix_Encode
+void Plan_C_Matrix_Encode(RotationPlan &plan, int dimension)
+{
+    Plan_Step(plan, -dimension);
+}
+
+// Decodes Ciphertext Matrix into vector of Ciphertexts
+// The matrix is rotated by dimension for every row so row i is in the first dimension slots, which are then masked
+vector<Ciphertext> C_Matrix_Decode(const Ciphertext &matrix, int dimension, double scale, const GaloisKeys &gal_keys, CKKSEncoder &ckks_encoder, Evaluator &evaluator)
+{
+    // Create mask vector with 1s in the first dimension slots and 0s everywhere else
+    vector<double> mask_vec(pow(dimension, 2), 0);
+    for (int j = 0; j < dimension; j++)
+    {
+        mask_vec[j] = 1;
+    }
+
+    // Encode mask vector
+    Plaintext mask_pt;
+    ckks_encoder.encode(mask_vec, scale, mask_pt);
+
+    vector<Ciphertext> ct_result(dimension);
+    Ciphertext matrix_rot = matrix;
+    for (int i = 0; i < dimension; i++)
+    {
+        // rotate row i to the front (not the first one)
+        if (i != 0)
+        {
+            evaluator.rotate_vector_inplace(matrix_rot, dimension, gal_keys);
+        }
+
+        // multiply matrix with mask
+        evaluator.multiply_plain(matrix_rot, mask_pt, ct_result[i]);
+    }
+
+    return ct_result;
+}
+
+// Levels of C_Matrix_Decode: the products with the mask, not rescaled
+int C_Matrix_Decode_Depth()
+{
+    return 1;
+}
+
+// Adds the rotations of C_Matrix_Decode
+void Plan_C_Matrix_Decode(RotationPlan &plan, int dimension)
+{
+    Plan_Step(plan, dimension);
+}
+
+// Tiled matrix multiplication: an m x k matrix A times a k x n matrix B is split in tile x tile blocks (zero padded at the edges),
+// C_ij = sum over l of A_il * B_lj, and the block products are batched CC_Batch_Capacity(tile) output blocks per CC_Matrix_Multiplication call
+
+// Rough rotation count of one CC_Matrix_Multiplication call of dimension tile with the matrix encoding of its inputs
+double CC_Matrix_Multiplication_Cost(int tile)
+{
+    return 3.0 * tile * tile + 5.0 * tile;
+}
+
+// Tile dimension of the tiled multiplication of m x k by k x n matrices that minimizes the estimated rotations
+// (smaller tiles need more block products, but more of them fit in one batch)
+int Tile_Dimension(int m, int k, int n, int slot_count)
+{
+    int max_tile = min((int)sqrt(slot_count / 2), max(m, max(k, n)));
+    int best_tile = 2;
+    double best_cost = -1;
+    for (int tile = 2; tile <= max(2, max_tile); tile++)
+    {
+        long long output_blocks = (long long)((m + tile - 1) / tile) * ((n + tile - 1) / tile);
+        long long inner_blocks = (k + tile - 1) / tile;
+        long long calls = ((output_blocks + CC_Batch_Capacity(tile, slot_count) - 1) / CC_Batch_Capacity(tile, slot_count)) * inner_blocks;
+        double cost = calls * CC_Matrix_Multiplication_Cost(tile);
+        if (best_cost < 0 || cost < best_cost)
+        {
+            best_tile = tile;
+            best_cost = cost;
+        }
+    }
+
+    return best_tile;
+}
+
+// Adds the rotations of the tiled multiplication of m x k by k x n matrices
+void Plan_Tiled_Matrix_Multiplication(RotationPlan &plan, int m, int k, int n)
+{
+    int tile = Tile_Dimension(m, k, n, plan.slot_count);
+    Plan_C_Matrix_Encode(plan, tile);
+    Plan_CC_Matrix_Multiplication(plan, tile);
+}
+
+// Gets block (block_row, block_col) of a matrix split in tile x tile blocks, zero padded
+vector<vector<double>> get_block(const vector<vector<double>> &matrix, int tile, int block_row, int block_col)
+{
+    vector<vector<double>> block(tile, vector<double>(tile, 0));
+    for (int i = 0; i < tile && block_row * tile + i < matrix.size(); i++)
+    {
+        for (int j = 0; j < tile && block_col * tile + j < matrix[0].size(); j++)
+        {
+            block[i][j] = matrix[block_row * tile + i][block_col * tile + j];
+        }
+    }
+
+    return block;
+}
+
+// Tiled encrypted multiplication of an m x k matrix A by a k x n matrix B
+// The blocks are streamed: for every batch of output blocks (i, j) and every inner block l, load_A_blocks and load_B_blocks return the
+// matrix encoded batch of blocks A_il and B_lj (in the order of the output blocks), the products are accumulated over l and the batch result
+// is passed to store_blocks, so only one batch of inputs and one accumulator are alive at a time
+// The diagonals must come from a bank of dimension tile and batch CC_Batch_Capacity(tile)
+void CC_Tiled_Matrix_Multiplication(int m, int k, int n, int tile,
+                                    function<Ciphertext(const vector<pair<int, int>> &)> load_A_blocks,
+                                    function<Ciphertext(const vector<pair<int, int>> &)> load_B_blocks,
+                                    function<void(const vector<pair<int, int>> &, const Ciphertext &)> store_blocks,
+                                    DiagonalBank &bank, HESession &session, int num_threads = 1)
+{
+    Evaluator &evaluator = session.evaluator;
+    int capacity = CC_Batch_Capacity(tile, session.ckks_encoder.slot_count());
+    int row_blocks = (m + tile - 1) / tile;
+    int inner_blocks = (k + tile - 1) / tile;
+    int col_blocks = (n + tile - 1) / tile;
+
+    const vector<Plaintext> &U_sigma_diagonals = Get_Bank_Diagonals(bank, BANK_U_SIGMA)[0];
+    const vector<Plaintext> &U_tau_diagonals = Get_Bank_Diagonals(bank, BANK_U_TAU)[0];
+    const vector<vector<Plaintext>> &V_diagonals = Get_Bank_Diagonals(bank, BANK_V_K);
+    const vector<vector<Plaintext>> &W_diagonals = Get_Bank_Diagonals(bank, BANK_W_K);
+
+    vector<pair<int, int>> output_blocks;
+    for (int i = 0; i < row_blocks; i++)
+    {
+        for (int j = 0; j < col_blocks; j++)
+        {
+            output_blocks.push_back({i, j});
+        }
+    }
+
+    for (int first = 0; first < output_blocks.size(); first += capacity)
+    {
+        vector<pair<int, int>> batch(output_blocks.begin() + first, output_blocks.begin() + min((int)output_blocks.size(), first + capacity));
+
+        Ciphertext accumulator;
+        for (int l = 0; l < inner_blocks; l++)
+        {
+            vector<pair<int, int>> A_blocks;
+            vector<pair<int, int>> B_blocks;
+            for (auto &block : batch)
+            {
+                A_blocks.push_back({block.first, l});
+                B_blocks.push_back({l, block.second});
+            }
+
+            Ciphertext product = CC_Matrix_Multiplication(load_A_blocks(A_blocks), load_B_blocks(B_blocks), tile, U_sigma_diagonals, U_tau_diagonals, V_diagonals, W_diagonals, session, num_threads);
+            if (l == 0)
+            {
+                accumulator = move(product);
+            }
+            else
+            {
+                evaluator.add_inplace(accumulator, product);
+            }
+        }
+
+        store_blocks(batch, accumulator);
+    }
+}
+
+// Tiled multiplication of plaintext matrices A (m x k) and B (k x n) through CC_Tiled_Matrix_Multiplication:
+// the blocks are encrypted when they are loaded and every result batch is decrypted as soon as it is stored
+// The session needs the keys of Plan_Tiled_Matrix_Multiplication(plan, m, k, n)
+vector<vector<double>> Tiled_Matrix_Multiplication(const vector<vector<double>> &A, const vector<vector<double>> &B, HESession &session, int num_threads = 1, const string &bank_directory = ".")
+{
+    int m = A.size();
+    int k = B.size();
+    int n = B[0].size();
+    if (A[0].size() != k)
+    {
+        cerr << "Matrix dimensions do not match: " << m << "x" << A[0].size() << " times " << k << "x" << n << endl;
+        exit(1);
+    }
+
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
+    int slot_count = ckks_encoder.slot_count();
+    int tile = Tile_Dimension(m, k, n, slot_count);
+    unique_ptr<DiagonalBank> bank = Open_Diagonal_Bank(bank_directory, tile, session, CC_Batch_Capacity(tile, slot_count));
+
+    auto encrypt_blocks = [&](const vector<vector<double>> &matrix, const vector<pair<int, int>> &blocks) {
+        vector<vector<vector<double>>> tiles;
+        for (auto &block : blocks)
+        {
+            tiles.push_back(get_block(matrix, tile, block.first, block.second));
+        }
+        vector<vector<double>> rows = Batch_Matrix_Rows(tiles, slot_count);
+        vector<Ciphertext> cipher_rows(tile);
+        for (int i = 0; i < tile; i++)
+        {
+            Plaintext plain_row;
+            ckks_encoder.encode(rows[i], session.scale, plain_row);
+            session.encryptor.encrypt(plain_row, cipher_rows[i]);
+        }
+        return C_Matrix_Encode(cipher_rows, session.gal_keys, session.evaluator);
+    };
+
+    vector<vector<double>> C(m, vector<double>(n, 0));
+    auto decrypt_blocks = [&](const vector<pair<int, int>> &blocks, const Ciphertext &result) {
+        Plaintext plain_result;
+        session.decryptor.decrypt(result, plain_result);
+        vector<double> slots;
+        ckks_encoder.decode(plain_result, slots);
+        vector<vector<vector<double>>> tiles = Unbatch_Matrices(slots, tile, blocks.size());
+        for (int b = 0; b < blocks.size(); b++)
+        {
+            for (int i = 0; i < tile && blocks[b].first * tile + i < m; i++)
+            {
+                for (int j = 0; j < tile && blocks[b].second * tile + j < n; j++)
+                {
+                    C[blocks[b].first * tile + i][blocks[b].second * tile + j] = tiles[b][i][j];
+                }
+            }
+        }
+    };
+
+    CC_Tiled_Matrix_Multiplication(
+        m, k, n, tile,
+        [&](const vector<pair<int, int>> &blocks) { return encrypt_blocks(A, blocks); },
+        [&](const vector<pair<int, int>> &blocks) { return encrypt_blocks(B, blocks); },
+        decrypt_blocks, *bank, session, num_threads);
+
+    return C;
+}
+
+// U_transpose (dense)
+template <typename T>
+vector<vector<double>> get_U_transpose(vector<vector<T>> U)
+{
+    return get_permutation_matrix(get_U_transpose_permutation(U.size()));
+}
+
+// The fill_prefix sum duplicates the size slots into [size, 2 * size) before it rotates, so it needs 2 * size slots
+void Check_Fill_Prefix_Slots(int size, int slot_count)
+{
+    if (2 * size > slot_count)
+    {
+        cerr << "Rotate_And_Sum with fill_prefix needs " << 2 * size << " slots but only " << slot_count << " are available" << endl;
+        exit(1);
+    }
+}
+
+// Rotate and sum: sums the first size slots of ct (zero everywhere else) with a logarithmic number of rotations
+// If fill_prefix is true the sum is left in every slot of [0, size) (the other slots hold partial sums), otherwise only slot 0 holds the sum
+void Rotate_And_Sum_inplace(Ciphertext &ct, int size, bool fill_prefix, const GaloisKeys &gal_keys, Evaluator &evaluator, MemoryPoolHandle pool = MemoryManager::GetPool())
+{
+    if (!fill_prefix)
+    {
+        // Zeros after size let the sum run over the next power of two
+        for (int i = 1; i < size; i <<= 1)
+        {
+            Ciphertext ct_rot(pool);
+            evaluator.rotate_vector(ct, i, gal_keys, ct_rot, pool);
+            evaluator.add_inplace(ct, ct_rot);
+        }
+        return;
+    }
+    Check_Fill_Prefix_Slots(size, ct.poly_modulus_degree() / 2);
+
+    // Fill ct with duplicate so every window of size slots starting in [0, size) holds all values
+    Ciphertext ct_rot(pool);
+    evaluator.rotate_vector(ct, -size, gal_keys, ct_rot, pool);
+    evaluator.add_inplace(ct, ct_rot);
+
+    // Binary decomposition of size: window holds sums of i consecutive slots (i = 1, 2, 4, ...)
+    // and result collects the windows of the bits set in size, each shifted by the bits already collected
+    Ciphertext window = move(ct);
+    Ciphertext result(pool);
+    int offset = 0;
+    for (int i = 1; i <= size; i <<= 1)
+    {
+        if (size & i)
+        {
+            if (offset == 0)
+            {
+                result = window;
+            }
+            else
+            {
+                evaluator.rotate_vector(window, offset, gal_keys, ct_rot, pool);
+                evaluator.add_inplace(result, ct_rot);
+            }
+            offset += i;
+        }
+        if ((i << 1) <= size)
+        {
+            evaluator.rotate_vector(window, i, gal_keys, ct_rot, pool);
+            evaluator.add_inplace(window, ct_rot);
+        }
+    }
+
+    ct = move(result);
+}
+
+// Rotate and sum returning the sum in a new ciphertext (ct is taken by value, move it in if it is not needed afterwards)
+Ciphertext Rotate_And_Sum(Ciphertext ct, int size, bool fill_prefix, const GaloisKeys &gal_keys, Evaluator &evaluator, MemoryPoolHandle pool = MemoryManager::GetPool())
+{
+    Rotate_And_Sum_inplace(ct, size, fill_prefix, gal_keys, evaluator, pool);
+    return ct;
+}
+
+// Adds the rotations of Rotate_And_Sum (and cipher_dot_product) over size slots
+void Plan_Rotate_And_Sum(RotationPlan &plan, int size, bool fill_prefix)
+{
+    if (!fill_prefix)
+    {
+        for (int i = 1; i < size; i <<= 1)
+        {
+            Plan_Step(plan, i);
+        }
+        return;
+    }
+    Check_Fill_Prefix_Slots(size, plan.slot_count);
+
+    Plan_Step(plan, -size);
+    int offset = 0;
+    for (int i = 1; i <= size; i <<= 1)
+    {
+        if (size & i)
+        {
+            Plan_Step(plan, offset);
+            offset += i;
+        }
+        if ((i << 1) <= size)
+        {
+            Plan_Step(plan, i);
+        }
+    }
+}
+
+// Strided rotate and sum: slot k of the result holds the sum of ct[k + i * step] for i in [0, count), count must be a power of two
+// step = 1 sums each segment of count slots into its first slot, step = -1 spreads the first slot of each segment over the segment
+void Segment_Rotate_And_Sum_inplace(Ciphertext &ct, int step, int count, const GaloisKeys &gal_keys, Evaluator &evaluator, MemoryPoolHandle pool = MemoryManager::GetPool())
+{
+    Ciphertext ct_rot(pool);
+    for (int i = 1; i < count; i <<= 1)
+    {
+        evaluator.rotate_vector(ct, i * step, gal_keys, ct_rot, pool);
+        evaluator.add_inplace(ct, ct_rot);
+    }
+}
+
+// Strided rotate and sum returning the sum in a new ciphertext (ct is taken by value, move it in if it is not needed afterwards)
+Ciphertext Segment_Rotate_And_Sum(Ciphertext ct, int step, int count, const GaloisKeys &gal_keys, Evaluator &evaluator, MemoryPoolHandle pool = MemoryManager::GetPool())
+{
+    Segment_Rotate_And_Sum_inplace(ct, step, count, gal_keys, evaluator, pool);
+    return ct;
+}
+
+// Adds the rotations of Segment_Rotate_And_Sum
+void Plan_Segment_Rotate_And_Sum(RotationPlan &plan, int step, int count)
+{
+    for (int i = 1; i < count; i <<= 1)
+    {
+        Plan_Step(plan, i * step);
+    }
+}
+
+// Gets the smallest power of two greater than or equal to n
+int next_power_of_two(int n)
+{
+    int power = 1;
+    while (power < n)
+    {
+        power <<= 1;
+    }
+    return power;
+}
+
+// Packs the rows of a matrix into vectors of slot_count slots, row r of a pack starts at slot r * width (width >= row size)
+vector<vector<double>> pack_rows(const vector<vector<double>> &matrix, int width, int slot_count)
+{
+    int rows_per_pack = slot_count / width;
+    int num_packs = (matrix.size() + rows_per_pack - 1) / rows_per_pack;
+
+    vector<vector<double>> packs(num_packs, vector<double>(slot_count, 0));
+    for (int i = 0; i < matrix.size(); i++)
+    {
+        int offset = (i % rows_per_pack) * width;
+        for (int j = 0; j < matrix[i].size(); j++)
+        {
+            packs[i / rows_per_pack][offset + j] = matrix[i][j];
+        }
+    }
+
+    return packs;
+}
+
+// Packs ciphertexts holding one row each (slots [0, width)) into ciphertexts holding slot_count / width rows, row r of a pack in slots [r * width, (r + 1) * width)
+// The rows of a pack are merged pairwise in a tree so every rotation is by a power of two multiple of width
+vector<Ciphertext> Pack_Rows(const vector<Ciphertext> &rows, int width, int slot_count, const GaloisKeys &gal_keys, Evaluator &evaluator)
+{
+    int rows_per_pack = slot_count / width;
+    int num_packs = (rows.size() + rows_per_pack - 1) / rows_per_pack;
+
+    vector<Ciphertext> packs(num_packs);
+    for (int p = 0; p < num_packs; p++)
+    {
+        int first = p * rows_per_pack;
+        int last = min((int)rows.size(), first + rows_per_pack);
+
+        // The first level reads the rows directly, only the merged pairs are stored
+        vector<Ciphertext> level;
+        for (int stride = width, size = last - first; size > 1; stride <<= 1)
+        {
+            const Ciphertext *source = level.empty() ? &rows[first] : level.data();
+            vector<Ciphertext> next_level((size + 1) / 2);
+            for (int i = 0; i < next_level.size(); i++)
+            {
+                if (2 * i + 1 < size)
+                {
+                    evaluator.rotate_vector(source[2 * i + 1], -stride, gal_keys, next_level[i]);
+                    evaluator.add_inplace(next_level[i], source[2 * i]);
+                }
+                else
+                {
+                    next_level[i] = source[2 * i];
+                }
+            }
+            level = move(next_level);
+            size = level.size();
+        }
+        packs[p] = level.empty() ? rows[first] : move(level[0]);
+    }
+
+    return packs;
+}
+
+// Adds the rotations of Pack_Rows of num_rows rows
+void Plan_Pack_Rows(RotationPlan &plan, int num_rows, int width)
+{
+    int size = min(num_rows, plan.slot_count / width);
+    for (int stride = width; size > 1; stride <<= 1)
+    {
+        Plan_Step(plan, -stride);
+        size = (size + 1) / 2;
+    }
+}
+
+// Cache of mask plaintexts, mask (index, length) has value (1 by default) in slot index of every segment of length slots
+// (length = slot_count gives a one-hot mask), each mask is encoded once per (parms_id, scale) and reused afterwards
+struct MaskCache
+{
+    map<tuple<int, int, parms_id_type, double, double>, Plaintext> masks;
+    mutex masks_mutex;
+};
+
+// Encodes mask (index, length) with value at parms_id and scale, without caching it
+// (for a value that changes every iteration, which a MaskCache would keep for the rest of the run)
+Plaintext encode_mask(int index, int length, parms_id_type parms_id, double scale, CKKSEncoder &ckks_encoder, double value = 1)
+{
+    vector<double> mask_vec(ckks_encoder.slot_count(), 0);
+    for (int i = index; i < mask_vec.size(); i += length)
+    {
+        mask_vec[i] = value;
+    }
+    Plaintext mask_pt;
+    ckks_encoder.encode(mask_vec, parms_id, scale, mask_pt);
+    return mask_pt;
+}
+
+// Gets mask (index, length) encoded at parms_id and scale, encoding it on first use (safe to call from parallel loops)
+// A value other than 1 folds a constant factor into the mask, which saves the level of a separate multiplication. The value is part of the
+// key, so it must be constant over the run: use encode_mask for a value that changes
+Plaintext &get_mask(MaskCache &mask_cache, int index, int length, parms_id_type parms_id, double scale, CKKSEncoder &ckks_encoder, double value = 1)
+{
+    lock_guard<mutex> lock(mask_cache.masks_mutex);
+    auto key = make_tuple(index, length, parms_id, scale, value);
+    auto it = mask_cache.masks.find(key);
+    if (it != mask_cache.masks.end())
+    {
+        return it->second;
+    }
+
+    Plaintext &mask_pt = mask_cache.masks[key];
+    mask_pt = encode_mask(index, length, parms_id, scale, ckks_encoder, value);
+    return mask_pt;
+}
+
+// Levels of cipher_dot_product: the product, rescaled once
+int Cipher_Dot_Product_Depth()
+{
+    return 1;
+}
+
+// Ciphertext dot product, the result keeps the exact scale ctA.scale() * ctB.scale() / q (q the prime removed by the rescale)
+Ciphertext cipher_dot_product(const Ciphertext &ctA, const Ciphertext &ctB, int size, const RelinKeys &relin_keys, const GaloisKeys &gal_keys, Evaluator &evaluator, bool fill_prefix = true, MemoryPoolHandle pool = MemoryManager::GetPool())
+{
+
+    // cout << "\nCTA Info:\n";
+    // cout << "\tLevel:\t" << context->get_context_data(ctA.parms_id())->chain_index() << endl;
+    // cout << "\tScale:\t" << log2(ctA.scale()) << endl;
+    // ios old_fmt(nullptr);
+    // old_fmt.copyfmt(cout);
+    // cout << fixed << setprecision(10);
+    // cout << "\tExact Scale:\t" << ctA.scale() << endl;
+    // cout.copyfmt(old_fmt);
+    // cout << "\tSize:\t" << ctA.size() << endl;
+
+    Ciphertext mult(pool);
+
+    // Component-wise multiplication
+    evaluator.multiply(ctA, ctB, mult, pool);
+
+    // cout << "\nMult Info:\n";
+    // cout << "\tLevel:\t" << context->get_context_data(mult.parms_id())->chain_index() << endl;
+    // cout << "\tScale:\t" << log2(mult.scale()) << endl;
+    // cout << "\tExact Scale:\t" << mult.scale() << endl;
+    // cout << "\tSize:\t" << mult.size() << endl;
+
+    evaluator.relinearize_inplace(mult, relin_keys, pool);
+    evaluator.rescale_to_next_inplace(mult, pool);
+
+    // cout << "\nMult Info:\n";
+    // cout << "\tLevel:\t" << context->get_context_data(mult.parms_id())->chain_index() << endl;
+    // cout << "\tScale:\t" << log2(mult.scale()) << endl;
+    // ios old_fmt1(nullptr);
+    // old_fmt1.copyfmt(cout);
+    // cout << fixed << setprecision(10);
+    // cout << "\tExact Scale:\t" << mult.scale() << endl;
+    // cout.copyfmt(old_fmt1);
+    // cout << "\tSize:\t" << mult.size() << endl;
+
+    // Sum the first size slots
+    Rotate_And_Sum_inplace(mult, size, fill_prefix, gal_keys, evaluator, pool);
+
+    // cout << "\nMult Info:\n";
+    // cout << "\tLevel:\t" << context->get_context_data(mult.parms_id())->chain_index() << endl;
+    // cout << "\tScale:\t" << log2(mult.scale()) << endl;
+    // ios old_fmt2(nullptr);
+    // old_fmt2.copyfmt(cout);
+    // cout << fixed << setprecision(10);
+    // cout << "\tExact Scale:\t" << mult.scale() << endl;
+    // cout.copyfmt(old_fmt2);
+    // cout << "\tSize:\t" << mult.size() << endl;
+
+    return mult;
+}
+
+// Helper for Tree method, computes powers of x in a tree
+void compute_all_powers(const Ciphertext &ctx, int degree, Evaluator &evaluator, const RelinKeys &relin_keys, vector<Ciphertext> &powers)
+{
+
+    powers.resize(degree + 1);
+    powers[1] = ctx;
+
+    vector<int> levels(degree + 1, 0);
+    levels[1] = 0;
+    levels[0] = 0;
+
+    for (int i = 2; i <= degree; i++)
+    {
+        // compute x^i
+        int minlevel = i;
+        int cand = -1;
+        for (int j = 1; j <= i / 2; j++)
+        {
+            int k = i - j;
+            int newlevel = max(levels[j], levels[k]) + 1;
+            if (newlevel < minlevel)
+            {
+                cand = j;
+                minlevel = newlevel;
+            }
+        }
+
+        levels[i] = minlevel;
+        // use cand
+        if (cand < 0)
+            throw runtime_error("error");
+        // cand <= i - cand by definition
+        Ciphertext temp = powers[cand];
+        evaluator.mod_switch_to_inplace(temp, powers[i - cand].parms_id());
+
+        evaluator.multiply(temp, powers[i - cand], powers[i]);
+
+        evaluator.relinearize_inplace(powers[i], relin_keys);
+
+        evaluator.rescale_to_next_inplace(powers[i]);
+    }
+
+    return;
+}
+
+// Plans the products computing x^e for every e of exponents at the minimum depth ceil(log2(e)), with only the intermediate powers they need
+// (for the odd sigmoid terms 1, 3, 5, 7: x^2, x^3, x^5 = x^2 * x^3, x^4, x^7 = x^4 * x^3). Entry (e, (a, b)) computes x^e = x^a * x^b,
+// the entries are in computation order
+vector<pair<int, pair<int, int>>> Plan_Powers(const set<int> &exponents)
+{
+    map<int, int> depths = {{1, 0}};
+    vector<pair<int, pair<int, int>>> plan;
+
+    function<void(int)> add_power = [&](int e) {
+        if (depths.count(e))
+        {
+            return;
+        }
+        int depth = 0;
+        while ((1 << depth) < e)
+        {
+            depth++;
+        }
+
+        // Prefer a product of two powers already planned, otherwise split at the largest power of two below e
+        int a = 1 << (depth - 1);
+        for (auto &power : depths)
+        {
+            int b = e - power.first;
+            if (b < power.first)
+            {
+                break;
+            }
+            if (depths.count(b) && max(power.second, depths[b]) < depth)
+            {
+                a = b;
+                break;
+            }
+        }
+        int b = e - a;
+        add_power(a);
+        add_power(b);
+
+        depths[e] = max(depths[a], depths[b]) + 1;
+        plan.push_back({e, {a, b}});
+    };
+
+    for (int e : exponents)
+    {
+        add_power(e);
+    }
+    return plan;
+}
+
+// Computes x^e for every e of exponents following Plan_Powers, powers[e] is left empty for the powers not needed
+void compute_powers(const Ciphertext &ctx, const set<int> &exponents, HESession &session, vector<Ciphertext> &powers)
+{
+    Evaluator &evaluator = session.evaluator;
+
+    powers.assign(exponents.empty() ? 2 : max(2, *exponents.rbegin() + 1), Ciphertext());
+    powers[1] = ctx;
+    for (auto &step : Plan_Powers(exponents))
+    {
+        int e = step.first;
+        int a = step.second.first;
+        int b = step.second.second;
+        if ((int)powers.size() <= e)
+        {
+            powers.resize(e + 1);
+        }
+
+        Ciphertext factor_a = powers[a];
+        Ciphertext factor_b = powers[b];
+        Match_Levels_inplace(factor_a, factor_b, session);
+        evaluator.multiply(factor_a, factor_b, powers[e]);
+        evaluator.relinearize_inplace(powers[e], session.relin_keys);
+        evaluator.rescale_to_next_inplace(powers[e]);
+    }
+}
+
+// Levels of Horner's method on a fresh ciphertext: one rescale per coefficient below the leading one
+int Horner_Depth(int degree)
+{
+    return degree;
+}
+
+// Levels of the tree method: the powers of the non-zero terms at depth ceil(log2(e)) (Plan_Powers), then one rescale for their coefficients
+int Tree_Depth(const vector<double> &coeffs)
+{
+    int depth = 0;
+    for (int e = 1; e < coeffs.size(); e++)
+    {
+        if (coeffs[e] == 0)
+        {
+            continue;
+        }
+        int power_depth = 0;
+        while ((1 << power_depth) < e)
+        {
+            power_depth++;
+        }
+        depth = max(depth, power_depth + 1);
+    }
+    return depth;
+}
+
+// Paterson-Stockmeyer evaluation of polynomials in y: a block of n coefficients with n > baby_steps is split at the largest giant step
+// y^(baby_steps * 2^t) below n into hi * y^(baby_steps * 2^t) + lo, the blocks of at most baby_steps coefficients are sums of scalar multiples
+// of the baby steps y^1 .. y^(baby_steps - 1). With baby_steps ~ sqrt(n) this takes O(sqrt(n)) non-scalar multiplications and log depth
+struct PSPowers
+{
+    int baby_steps;
+    vector<Ciphertext> baby;  // baby[i] = y^i
+    vector<Ciphertext> giant; // giant[t] = y^(baby_steps * 2^t)
+};
+
+// Coefficients without the trailing zeros
+vector<double> trim_coeffs(vector<double> coeffs)
+{
+    while (!coeffs.empty() && coeffs.back() == 0)
+    {
+        coeffs.pop_back();
+    }
+    return coeffs;
+}
+
+// Giant step splitting a block of n > baby_steps coefficients (largest t with baby_steps * 2^t < n)
+int PS_Giant_Index(int n, int baby_steps)
+{
+    int t = 0;
+    while ((baby_steps << (t + 1)) < n)
+    {
+        t++;
+    }
+    return t;
+}
+
+int PS_Chain_Index(const vector<double> &coeffs, const PSPowers &powers, const shared_ptr<SEALContext> &context);
+
+// Chain index of hi(y) * power
+int PS_Product_Chain_Index(const vector<double> &hi, const Ciphertext &power, const PSPowers &powers, const shared_ptr<SEALContext> &context)
+{
+    int hi_index = PS_Chain_Index(hi, powers, context);
+    int power_index = Chain_Index(context, power);
+    return (hi_index < 0 ? power_index : min(hi_index, power_index)) - 1;
+}
+
+// Chain index of the evaluation of coeffs (in y), -1 when it is a constant (no ciphertext)
+// The levels only depend on the powers, so every block can be placed before it is evaluated
+int PS_Chain_Index(const vector<double> &coeffs, const PSPowers &powers, const shared_ptr<SEALContext> &context)
+{
+    vector<double> c = trim_coeffs(coeffs);
+    int n = c.size();
+    if (n <= 1)
+    {
+        return -1;
+    }
+
+    if (n <= powers.baby_steps)
+    {
+        int index = INT_MAX;
+        for (int i = 1; i < n; i++)
+        {
+            if (c[i] != 0)
+            {
+                index = min(index, Chain_Index(context, powers.baby[i]) - 1);
+            }
+        }
+        return index;
+    }
+
+    int t = PS_Giant_Index(n, powers.baby_steps);
+    int split = powers.baby_steps << t;
+    int index = PS_Product_Chain_Index(vector<double>(c.begin() + split, c.end()), powers.giant[t], powers, context);
+    vector<double> lo(c.begin(), c.begin() + split);
+    lo[0] = 0;
+    int lo_index = PS_Chain_Index(lo, powers, context);
+    return lo_index < 0 ? index : min(index, lo_index);
+}
+
+bool PS_Evaluate(const vector<double> &coeffs, const PSPowers &powers, double target_scale, HESession &session, Ciphertext &result);
+
+// hi(y) * power at PS_Product_Chain_Index, exactly at target_scale (hi must not be zero)
+void PS_Product(const vector<double> &hi, const Ciphertext &power, const PSPowers &powers, double target_scale, HESession &session, Ciphertext &result)
+{
+    auto context = session.context;
+    Evaluator &evaluator = session.evaluator;
+
+    parms_id_type parms_id = Chain_Parms_Id(context, PS_Product_Chain_Index(hi, power, powers, context) + 1);
+    Ciphertext power_switched;
+    evaluator.mod_switch_to(power, parms_id, power_switched);
+
+    // hi is evaluated at the scale whose product with power rescales exactly to target_scale
+    double hi_scale = Target_Plain_Scale(context, parms_id, power.scale(), target_scale);
+    Ciphertext hi_ct;
+    if (PS_Evaluate(hi, powers, hi_scale, session, hi_ct))
+    {
+        evaluator.mod_switch_to_inplace(hi_ct, parms_id);
+        evaluator.multiply(hi_ct, power_switched, result);
+        evaluator.relinearize_inplace(result, session.relin_keys);
+    }
+    else
+    {
+        Plaintext hi_pt;
+        session.ckks_encoder.encode(trim_coeffs(hi)[0], parms_id, hi_scale, hi_pt);
+        evaluator.multiply_plain(power_switched, hi_pt, result);
+    }
+    evaluator.rescale_to_next_inplace(result);
+}
+
+// Evaluates coeffs (in y) exactly at target_scale, returns false when it is a constant (no ciphertext)
+bool PS_Evaluate(const vector<double> &coeffs, const PSPowers &powers, double target_scale, HESession &session, Ciphertext &result)
+{
+    auto context = session.context;
+    Evaluator &evaluator = session.evaluator;
+
+    vector<double> c = trim_coeffs(coeffs);
+    int n = c.size();
+    if (n <= 1)
+    {
+        return false;
+    }
+    int chain_index = PS_Chain_Index(c, powers, context);
+
+    if (n <= powers.baby_steps)
+    {
+        // Scalar multiples of the baby steps, all rescaled exactly to target_scale at chain_index
+        parms_id_type term_parms_id = Chain_Parms_Id(context, chain_index + 1);
+        vector<Ciphertext> terms;
+        for (int i = 1; i < n; i++)
+        {
+            if (c[i] == 0)
+            {
+                continue;
+            }
+            Ciphertext term;
+            evaluator.mod_switch_to(powers.baby[i], term_parms_id, term);
+            Multiply_Const_Rescale_inplace(term, c[i], target_scale, session);
+            terms.push_back(move(term));
+        }
+        result = add_tree(move(terms), evaluator);
+    }
+    else
+    {
+        // hi * giant + lo, the constant of lo is added last
+        int t = PS_Giant_Index(n, powers.baby_steps);
+        int split = powers.baby_steps << t;
+        PS_Product(vector<double>(c.begin() + split, c.end()), powers.giant[t], powers, target_scale, session, result);
+
+        vector<double> lo(c.begin(), c.begin() + split);
+        lo[0] = 0;
+        Ciphertext lo_ct;
+        if (PS_Evaluate(lo, powers, target_scale, session, lo_ct))
+        {
+            Match_Levels_inplace(result, lo_ct, session);
+            evaluator.add_inplace(result, lo_ct);
+        }
+    }
+    evaluator.mod_switch_to_inplace(result, Chain_Parms_Id(context, chain_index));
+    Add_Const_inplace(result, c[0], session);
+
+    return true;
+}
+
+// Evaluates sum coeffs[i] * x^i as even(y) + x * odd(y) with y = x^2, both evaluated with Paterson-Stockmeyer on the same powers of y,
+// so odd polynomials (such as the sigmoid approximations apart from their constant) need no even powers of x. The result is exactly at session.scale
+Ciphertext PS_Polynomial(const Ciphertext &ctx, const vector<double> &coeffs, HESession &session)
+{
+    Evaluator &evaluator = session.evaluator;
+
+    vector<double> even, odd;
+    for (int i = 0; i < coeffs.size(); i++)
+    {
+        (i % 2 ? odd : even).push_back(coeffs[i]);
+    }
+    even = trim_coeffs(even);
+    odd = trim_coeffs(odd);
+
+    // Baby and giant steps of y for the longer of the two polynomials
+    int n = max(even.size(), odd.size());
+    PSPowers powers;
+    powers.baby_steps = max(1, (int)ceil(sqrt(n)));
+    if (n > 1)
+    {
+        Ciphertext y;
+        evaluator.square(ctx, y);
+        evaluator.relinearize_inplace(y, session.relin_keys);
+        evaluator.rescale_to_next_inplace(y);
+
+        compute_all_powers(y, n > powers.baby_steps ? powers.baby_steps : n - 1, evaluator, session.relin_keys, powers.baby);
+        if (n > powers.baby_steps)
+        {
+            powers.giant.push_back(powers.baby[powers.baby_steps]);
+            for (int t = 1; t <= PS_Giant_Index(n, powers.baby_steps); t++)
+            {
+                Ciphertext giant;
+                evaluator.square(powers.giant[t - 1], giant);
+                evaluator.relinearize_inplace(giant, session.relin_keys);
+                evaluator.rescale_to_next_inplace(giant);
+                powers.giant.push_back(move(giant));
+            }
+        }
+    }
+
+    Ciphertext result;
+    bool has_result = false;
+    if (!odd.empty())
+    {
+        PS_Product(odd, ctx, powers, session.scale, session, result);
+        has_result = true;
+    }
+    if (!even.empty())
+    {
+        vector<double> even_terms = even;
+        even_terms[0] = 0;
+        Ciphertext even_ct;
+        if (PS_Evaluate(even_terms, powers, session.scale, session, even_ct))
+        {
+            if (has_result)
+            {
+                Match_Levels_inplace(result, even_ct, session);
+                evaluator.add_inplace(result, even_ct);
+            }
+            else
+            {
+                result = move(even_ct);
+            }
+            has_result = true;
+        }
+    }
+    if (!has_result)
+    {
+        // Constant polynomial
+        Plaintext zero_pt;
+        session.ckks_encoder.encode(0.0, session.scale, zero_pt);
+        session.encryptor.encrypt(zero_pt, result);
+    }
+    Add_Const_inplace(result, even.empty() ? 0 : even[0], session);
+
+    return result;
+}
+
+// Levels of PS_Evaluate on the powers of y = x^2 (-1 for a constant), the same structure as PS_Chain_Index with the depth of each power in
+// x: y^i is at depth 1 + ceil(log2(i)) (compute_all_powers) and the giant step t at the depth of y^baby_steps plus t squarings
+int PS_Block_Depth(const vector<double> &coeffs, int baby_steps)
+{
+    auto baby_depth = [](int i) {
+        int depth = 1;
+        while ((1 << (depth - 1)) < i)
+        {
+            depth++;
+        }
+        return depth;
+    };
+
+    vector<double> c = trim_coeffs(coeffs);
+    int n = c.size();
+    if (n <= 1)
+    {
+        return -1;
+    }
+
+    if (n <= baby_steps)
+    {
+        int depth = 0;
+        for (int i = 1; i < n; i++)
+        {
+            if (c[i] != 0)
+            {
+                depth = max(depth, baby_depth(i) + 1);
+            }
+        }
+        return depth;
+    }
+
+    int t = PS_Giant_Index(n, baby_steps);
+    int split = baby_steps << t;
+    int depth = max(PS_Block_Depth(vector<double>(c.begin() + split, c.end()), baby_steps), baby_depth(baby_steps) + t) + 1;
+    vector<double> lo(c.begin(), c.begin() + split);
+    lo[0] = 0;
+    return max(depth, PS_Block_Depth(lo, baby_steps));
+}
+
+// Levels PS_Polynomial uses, without evaluating it
+int PS_Depth(const vector<double> &coeffs)
+{
+    vector<double> even, odd;
+    for (int i = 0; i < coeffs.size(); i++)
+    {
+        (i % 2 ? odd : even).push_back(coeffs[i]);
+    }
+    even = trim_coeffs(even);
+    odd = trim_coeffs(odd);
+
+    int n = max(even.size(), odd.size());
+    int baby_steps = max(1, (int)ceil(sqrt(n)));
+    int depth = 0;
+    if (!odd.empty())
+    {
+        depth = max(PS_Block_Depth(odd, baby_steps), 0) + 1;
+    }
+    if (!even.empty())
+    {
+        even[0] = 0;
+        depth = max(depth, PS_Block_Depth(even, baby_steps));
+    }
+    return depth;
+}
+
+// Writes a length prefixed message to fd
+void Write_Message(int fd, const string &message)
+{
+    uint64_t size = message.size();
+    string frame((const char *)&size, sizeof(size));
+    frame += message;
+    for (size_t written = 0; written < frame.size();)
+    {
+        ssize_t count = write(fd, frame.data() + written, frame.size() - written);
+        if (count <= 0)
+        {
+            cerr << "Couldn't write refresh message" << endl;
+            exit(1);
+        }
+        written += count;
+    }
+}
+
+// Reads a length prefixed message from fd, returns false when the other end is closed
+bool Read_Message(int fd, string &message)
+{
+    auto read_all = [fd](char *data, size_t size) {
+        for (size_t done = 0; done < size;)
+        {
+            ssize_t count = read(fd, data + done, size - done);
+            if (count <= 0)
+            {
+                return false;
+            }
+            done += count;
+        }
+        return true;
+    };
+
+    uint64_t size;
+    if (!read_all((char *)&size, sizeof(size)))
+    {
+        return false;
+    }
+    message.resize(size);
+    if (!read_all(&message[0], size))
+    {
+        cerr << "Truncated refresh message" << endl;
+        exit(1);
+    }
+    return true;
+}
+
+// Client-aided refresh (no bootstrapping): the compute server sends a ciphertext to the key holder, which decrypts it and sends back
+// a fresh encryption of the same slots at the first level. The local stand-in runs the key holder on a thread at the other end of a socketpair,
+// with the keys of the session; the server side only exchanges serialized ciphertexts with it.
+// Refresh_Send returns as soon as the request is written, so the server can do work that does not need the refreshed ciphertext
+// before Refresh_Receive (see train_cipher)
+struct RefreshService
+{
+    int server_fd = -1;
+    int client_fd = -1;
+    thread client;
+    shared_ptr<SEALContext> context;
+
+    // Round trip statistics: time from Refresh_Send to the end of Refresh_Receive, and the part of it the server spent blocked in both calls
+    chrono::high_resolution_clock::time_point sent;
+    long long round_trip_us = 0;
+    long long wait_us = 0;
+    int refreshes = 0;
+
+    // on_refresh sees the decrypted slots of every refresh on the key holder side (e.g. to log progress)
+    RefreshService(HESession &session, function<void(int, const vector<double> &)> on_refresh = nullptr) : context(session.context)
+    {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0)
+        {
+            cerr << "Couldn't create the refresh socketpair" << endl;
+            exit(1);
+        }
+        server_fd = fds[0];
+        client_fd = fds[1];
+
+        client = thread([this, &session, on_refresh]() {
+            string message;
+            for (int count = 0; Read_Message(client_fd, message); count++)
+            {
+                stringstream request(message);
+                Ciphertext ct;
+                ct.load(session.context, request);
+
+                Plaintext pt;
+                vector<double> slots;
+                session.decryptor.decrypt(ct, pt);
+                session.ckks_encoder.decode(pt, slots);
+                if (on_refresh)
+                {
+                    on_refresh(count, slots);
+                }
+
+                // Encode again at the first level since the decrypted plaintext is at the level of ct
+                session.ckks_encoder.encode(slots, session.scale, pt);
+                session.encryptor.encrypt(pt, ct);
+
+                stringstream response;
+                ct.save(response, compr_mode_type::none);
+                Write_Message(client_fd, response.str());
+            }
+        });
+    }
+
+    RefreshService(const RefreshService &) = delete;
+    RefreshService &operator=(const RefreshService &) = delete;
+
+    ~RefreshService()
+    {
+        // The key holder stops at the end of the stream
+        shutdown(server_fd, SHUT_WR);
+        client.join();
+        close(server_fd);
+        close(client_fd);
+    }
+};
+
+// Sends ct to the key holder (at most one refresh in flight)
+void Refresh_Send(RefreshService &service, const Ciphertext &ct)
+{
+    stringstream request;
+    ct.save(request, compr_mode_type::none);
+    service.sent = chrono::high_resolution_clock::now();
+    Write_Message(service.server_fd, request.str());
+    service.wait_us += chrono::duration_cast<chrono::microseconds>(chrono::high_resolution_clock::now() - service.sent).count();
+}
+
+// Waits for the refreshed ciphertext of the last Refresh_Send
+void Refresh_Receive(RefreshService &service, Ciphertext &ct)
+{
+    auto wait_start = chrono::high_resolution_clock::now();
+    string message;
+    if (!Read_Message(service.server_fd, message))
+    {
+        cerr << "Refresh client closed the connection" << endl;
+        exit(1);
+    }
+    auto stop = chrono::high_resolution_clock::now();
+
+    stringstream response(message);
+    ct.load(service.context, response);
+
+    service.round_trip_us += chrono::duration_cast<chrono::microseconds>(stop - service.sent).count();
+    service.wait_us += chrono::duration_cast<chrono::microseconds>(stop - wait_start).count();
+    service.refreshes++;
+}
+
+// Prints the average round trip of the refreshes and how much of it was hidden behind server work
+void print_refresh_stats(const RefreshService &service)
+{
+    if (service.refreshes == 0)
+    {
+        return;
+    }
+    long long round_trip = service.round_trip_us / service.refreshes;
+    long long wait = service.wait_us / service.refreshes;
+    cout << "Refresh round trip:\t" << round_trip << " us (" << service.refreshes << " refreshes), waited " << wait << " us, hidden " << round_trip - wait << " us" << endl;
+}
+
+// Runtime configuration: key = value lines of a config file (# starts a comment) overridden by --key=value or --key value flags
+// (a flag without a value is a switch set to 1). --config=file names the file. Every key must be one of keys (key -> description),
+// so a misspelled key fails instead of silently running the default
+struct Config
+{
+    map<string, string> keys;
+    map<string, string> values;
+};
+
+void print_config_usage(const Config &config, const string &program)
+{
+    cout << "Usage: " << program << " [--config=file] [--key=value ...]" << endl;
+    for (auto &key : config.keys)
+    {
+        cout << "  --" << left << setw(24) << key.first << key.second << endl;
+    }
+}
+
+void Config_Set(Config &config, const string &key, const string &value)
+{
+    if (config.keys.count(key) == 0)
+    {
+        cerr << "Unknown configuration key: " << key << endl;
+        exit(EXIT_FAILURE);
+    }
+    config.values[key] = value;
+}
+
+string trim_spaces(const string &text)
+{
+    size_t first = text.find_first_not_of(" \t\r");
+    if (first == string::npos)
+    {
+        return "";
+    }
+    return text.substr(first, text.find_last_not_of(" \t\r") - first + 1);
+}
+
+void Load_Config_File(Config &config, const string &filename)
+{
+    ifstream file(filename);
+    if (!file)
+    {
+        cerr << "Couldn't open config file " << filename << endl;
+        exit(EXIT_FAILURE);
+    }
+
+    string line;
+    for (int line_number = 1; getline(file, line); line_number++)
+    {
+        line = trim_spaces(line.substr(0, line.find('#')));
+        if (line.empty())
+        {
+            continue;
+        }
+        size_t equals = line.find('=');
+        if (equals == string::npos)
+        {
+            cerr << filename << ":" << line_number << ": expected key = value" << endl;
+            exit(EXIT_FAILURE);
+        }
+        Config_Set(config, trim_spaces(line.substr(0, equals)), trim_spaces(line.substr(equals + 1)));
+    }
+}
+
+Config Load_Config(int argc, char **argv, map<string, string> keys)
+{
+    Config config;
+    config.keys = move(keys);
+    config.keys["config"] = "config file of key = value lines, overridden by the other flags";
+
+    vector<pair<string, string>> flags;
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--help" || arg == "-h")
+        {
+            print_config_usage(config, argv[0]);
+            exit(EXIT_SUCCESS);
+        }
+        if (arg.compare(0, 2, "--") != 0)
+        {
+            cerr << "Unexpected argument: " << arg << endl;
+            exit(EXIT_FAILURE);
+        }
+
+        arg = arg.substr(2);
+        size_t equals = arg.find('=');
+        if (equals != string::npos)
+        {
+            flags.emplace_back(arg.substr(0, equals), arg.substr(equals + 1));
+        }
+        else if (i + 1 < argc && string(argv[i + 1]).compare(0, 2, "--") != 0)
+        {
+            flags.emplace_back(arg, argv[++i]);
+        }
+        else
+        {
+            flags.emplace_back(arg, "1");
+        }
+    }
+
+    // The file is read first so the flags override it wherever --config appears
+    for (auto &flag : flags)
+    {
+        if (flag.first == "config")
+        {
+            Load_Config_File(config, flag.second);
+        }
+    }
+    for (auto &flag : flags)
+    {
+        if (flag.first != "config")
+        {
+            Config_Set(config, flag.first, flag.second);
+        }
+    }
+    return config;
+}
+
+string Config_String(const Config &config, const string &key, const string &default_value)
+{
+    auto value = config.values.find(key);
+    return value == config.values.end() ? default_value : value->second;
+}
+
+double Config_Double(const Config &config, const string &key, double default_value)
+{
+    auto value = config.values.find(key);
+    if (value == config.values.end())
+    {
+        return default_value;
+    }
+
+    char *end;
+    double result = strtod(value->second.c_str(), &end);
+    if (value->second.empty() || *end != '\0')
+    {
+        cerr << "Invalid number for " << key << ": " << value->second << endl;
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+int Config_Int(const Config &config, const string &key, int default_value)
+{
+    // The range is checked before the cast, which is undefined for values outside int (and for inf and nan)
+    double result = Config_Double(config, key, default_value);
+    if (!(isfinite(result) && result >= INT_MIN && result <= INT_MAX && result == floor(result)))
+    {
+        cerr << "Invalid integer for " << key << ": " << result << endl;
+        exit(EXIT_FAILURE);
+    }
+    return result;
+}
+
+bool Config_Bool(const Config &config, const string &key, bool default_value)
+{
+    string value = Config_String(config, key, default_value ? "1" : "0");
+    if (value == "1" || value == "true" || value == "yes" || value == "on")
+    {
+        return true;
+    }
+    if (value == "0" || value == "false" || value == "no" || value == "off")
+    {
+        return false;
+    }
+    cerr << "Invalid switch for " << key << ": " << value << endl;
+    exit(EXIT_FAILURE);
+}
+
+// Comma separated integers, e.g. the bit sizes of a coeff_modulus
+vector<int> Config_Int_List(const Config &config, const string &key, const vector<int> &default_value)
+{
+    auto value = config.values.find(key);
+    if (value == config.values.end())
+    {
+        return default_value;
+    }
+
+    vector<int> result;
+    stringstream list(value->second);
+    string item;
+    while (getline(list, item, ','))
+    {
+        char *end;
+        item = trim_spaces(item);
+        long bits = strtol(item.c_str(), &end, 10);
+        result.push_back(bits);
+        if (item.empty() || *end != '\0' || bits < INT_MIN || bits > INT_MAX)
+        {
+            cerr << "Invalid integer list for " << key << ": " << value->second << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    return result;
+}
+
+// Modulus chain with depth rescales: the first prime keeps the integer part and precision of the decrypted results, the depth primes
+// of scale_bits are divided out by the rescales and the special prime of key switching is as large as the first one
+vector<int> Chain_Bit_Sizes(int depth, int scale_bits, int first_bits = 60)
+{
+    vector<int> bit_sizes(depth + 2, scale_bits);
+    bit_sizes.front() = first_bits;
+    bit_sizes.back() = first_bits;
+    return bit_sizes;
+}
+
+// Largest poly_modulus_degree SEAL supports
+const size_t MAX_POLY_MODULUS_DEGREE = 32768;
+
+// Exits if min_slots values cannot fit in the slots of any poly_modulus_degree (whatever the coeff_modulus)
+void Check_Slot_Count(size_t min_slots)
+{
+    if (min_slots > MAX_POLY_MODULUS_DEGREE / 2)
+    {
+        cerr << min_slots << " slots are needed but the largest poly_modulus_degree (" << MAX_POLY_MODULUS_DEGREE << ") only has "
+             << MAX_POLY_MODULUS_DEGREE / 2 << endl;
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Smallest poly_modulus_degree whose coeff_modulus bound at 128-bit security holds bit_sizes and whose slots hold min_slots values, 0 if none does
+size_t Find_Secure_Poly_Modulus_Degree(const vector<int> &bit_sizes, size_t min_slots = 1)
+{
+    int total_bits = accumulate(bit_sizes.begin(), bit_sizes.end(), 0);
+    for (size_t poly_modulus_degree = 1024; poly_modulus_degree <= MAX_POLY_MODULUS_DEGREE; poly_modulus_degree <<= 1)
+    {
+        if (CoeffModulus::MaxBitCount(poly_modulus_degree, sec_level_type::tc128) >= total_bits && poly_modulus_degree / 2 >= min_slots)
+        {
+            return poly_modulus_degree;
+        }
+    }
+    return 0;
+}
+
+// Same as Find_Secure_Poly_Modulus_Degree, but exits (reporting the slots or the coeff_modulus as the cause) if no poly_modulus_degree fits
+size_t Secure_Poly_Modulus_Degree(const vector<int> &bit_sizes, size_t min_slots = 1)
+{
+    Check_Slot_Count(min_slots);
+    size_t poly_modulus_degree = Find_Secure_Poly_Modulus_Degree(bit_sizes, min_slots);
+    if (poly_modulus_degree == 0)
+    {
+        cerr << "No poly_modulus_degree holds a " << accumulate(bit_sizes.begin(), bit_sizes.end(), 0) << " bit coeff_modulus at 128-bit security" << endl;
+        exit(EXIT_FAILURE);
+    }
+    return poly_modulus_degree;
+}
+
+// Encryption parameters chosen by Plan_Parameters, the scale is 2^scale_bits
+struct ParameterPlan
+{
+    size_t poly_modulus_degree = 0;
+    vector<int> bit_sizes;
+    int scale_bits = 0;
+};
+
+// Smallest poly_modulus_degree (from min_poly_modulus_degree) and prime sizes at 128-bit security for a computation of depth rescales whose
+// results keep precision_bits fractional bits and integer_bits integer bits. The errors of the encoding, the encryption and every rescale
+// are a few times sqrt(N) at the scale and add up over the levels, so the scale is log2(sqrt(N) * (depth + 1)) + 5 bits above the precision.
+// The first prime holds the integer part on top of the scale and the special prime is as large as the first one
+ParameterPlan Plan_Parameters(int depth, int precision_bits, int integer_bits, size_t min_slots = 1, size_t min_poly_modulus_degree = 1024)
+{
+    Check_Slot_Count(max(min_slots, min_poly_modulus_degree / 2));
+
+    int depth_bits = 0;
+    while ((1 << depth_bits) < depth + 1)
+    {
+        depth_bits++;
+    }
+
+    // The noise, and so the scale, grows with N: the chain is built for each candidate N and kept if the smallest secure N for it
+    // (Find_Secure_Poly_Modulus_Degree) is not larger than the candidate
+    for (size_t candidate = 1024; candidate <= MAX_POLY_MODULUS_DEGREE; candidate <<= 1)
+    {
+        int log_degree = 0;
+        while (((size_t)1 << log_degree) < candidate)
+        {
+            log_degree++;
+        }
+
+        // Enough primes of scale_bits that are 1 mod 2N only exist well above log2(2N)
+        int scale_bits = max(precision_bits + (log_degree + 1) / 2 + depth_bits + 5, log_degree + 11);
+        int first_bits = scale_bits + integer_bits;
+        if (first_bits > 60)
+        {
+            continue;
+        }
+        vector<int> bit_sizes = Chain_Bit_Sizes(depth, scale_bits, first_bits);
+        size_t poly_modulus_degree = Find_Secure_Poly_Modulus_Degree(bit_sizes, max(min_slots, min_poly_modulus_degree / 2));
+        if (poly_modulus_degree != 0 && poly_modulus_degree <= candidate)
+        {
+            ParameterPlan plan;
+            plan.poly_modulus_degree = poly_modulus_degree;
+            plan.bit_sizes = bit_sizes;
+            plan.scale_bits = scale_bits;
+            return plan;
+        }
+    }
+    cerr << "No parameters at 128-bit security hold depth " << depth << " with " << precision_bits << " fractional and " << integer_bits << " integer bits" << endl;
+    exit(EXIT_FAILURE);
+}
+
+// Gets a random float between a and b
+float RandomFloat(float a, float b)
+{
+    float random = ((float)rand()) / (float)RAND_MAX;
+    float diff = b - a;
+    float r = random * diff;
+    return a + r;
+}
+
+// CSV to string matrix converter
+vector<vector<string>> CSVtoMatrix(string filename)
+{
+    vector<vector<string>> result_matrix;
+
+    ifstream data(filename);
+    string line;
+    int line_count = 0;
+    while (getline(data, line))
+    {
+        stringstream lineStream(line);
+        string cell;
+        vector<string> parsedRow;
+        while (getline(lineStream, cell, ','))
+        {
+            parsedRow.push_back(cell);
+        }
+        // Skip first line since it has text instead of numbers
+        if (line_count != 0)
+        {
+            result_matrix.push_back(parsedRow);
+        }
+        line_count++;
+    }
+    return result_matrix;
+}
+
+// String matrix to float matrix converter
+vector<vector<double>> stringToDoubleMatrix(vector<vector<string>> matrix)
+{
+    vector<vector<double>> result(matrix.size(), vector<double>(matrix[0].size()));
+    for (int i = 0; i < matrix.size(); i++)
+    {
+        for (int j = 0; j < matrix[0].size(); j++)
         {
             result[i][j] = ::atof(matrix[i][j].c_str());
             result[i][j] = static_cast<double>(result[i][j]);
@@ -697,155 +3188,30 @@ void print_full_vector(vector<T> vec)
     cout << vec[vec.size() - 1] << " ]" << endl;
 }
 
-// U_sigma
+// U_sigma (dense)
 template <typename T>
 vector<vector<double>> get_U_sigma(vector<vector<T>> U)
 {
-    int dimension = U.size();
-    int dimensionSq = pow(dimension, 2);
-    vector<vector<double>> U_sigma(dimensionSq, vector<double>(dimensionSq));
-
-    int k = 0;
-    int sigma_row = 0;
-    for (int offset = 0; offset < dimensionSq; offset += dimension)
-    {
-        // Get the matrix of ones at position k
-        vector<vector<double>> one_matrix = get_matrix_of_ones(k, U);
-        // print_full_matrix(one_matrix);
-        // Loop over the matrix of ones
-        for (int one_matrix_index = 0; one_matrix_index < dimension; one_matrix_index++)
-        {
-            // Pad with zeros the vector of one
-            vector<double> temp_fill = pad_zero(offset, one_matrix[one_matrix_index]);
-            // Store vector in U_sigma at position index_sigma
-            // print_full_vector(temp_fill);
-            U_sigma[sigma_row] = temp_fill;
-            sigma_row++;
-        }
-
-        k++;
-    }
-
-    return U_sigma;
+    return get_permutation_matrix(get_U_sigma_permutation(U.size()));
 }
 
-// U_sigma
+// U_tau (dense)
 template <typename T>
 vector<vector<double>> get_U_tau(vector<vector<T>> U)
 {
-    int dimension = U.size();
-    int dimensionSq = pow(dimension, 2);
-    vector<vector<double>> U_tau(dimensionSq, vector<double>(dimensionSq));
-
-    int tau_row = 0;
-    // Divide the matrix into blocks of size = dimension
-    for (int i = 0; i < dimension; i++)
-    {
-        // Get the matrix of ones at position i
-        vector<vector<double>> one_matrix = get_matrix_of_ones(0, U);
-        // print_full_matrix(one_matrix);
-        // Loop over the matrix of ones and store in U_tau the rows of the matrix of ones with the offset
-        int offset = i * dimension;
-
-        for (int j = 0; j < dimension; j++)
-        {
-            vector<double> temp_fill = pad_zero(offset, one_matrix[j]);
-            // print_full_vector(temp_fill);
-            U_tau[tau_row] = temp_fill;
-            tau_row++;
-            // Update offset
-            if (offset + dimension == dimensionSq)
-            {
-                offset = 0;
-            }
-            else
-            {
-                offset += dimension;
-            }
-        }
-    }
-
-    return U_tau;
+    return get_permutation_matrix(get_U_tau_permutation(U.size()));
 }
 
-// V_k
+// V_k (dense)
 template <typename T>
 vector<vector<double>> get_V_k(vector<vector<T>> U, int k)
 {
-
-    int dimension = U.size();
-    if (k < 1 || k >= dimension)
-    {
-        cerr << "Invalid K for matrix V_k: " << to_string(k) << ". Choose k to be between 1 and " << to_string(dimension) << endl;
-        exit(1);
-    }
-
-    int dimensionSq = pow(dimension, 2);
-    vector<vector<double>> V_k(dimensionSq, vector<double>(dimensionSq));
-
-    int V_row = 0;
-    for (int offset = 0; offset < dimensionSq; offset += dimension)
-    {
-        // Get the matrix of ones at position k
-        vector<vector<double>> one_matrix = get_matrix_of_ones(k, U);
-        // print_full_matrix(one_matrix);
-        // Loop over the matrix of ones
-        for (int one_matrix_index = 0; one_matrix_index < dimension; one_matrix_index++)
-        {
-            // Pad with zeros the vector of one
-            vector<double> temp_fill = pad_zero(offset, one_matrix[one_matrix_index]);
-            // Store vector in V_k at position V_row
-            // print_full_vector(temp_fill);
-            V_k[V_row] = temp_fill;
-            V_row++;
-        }
-    }
-
-    return V_k;
+    return get_permutation_matrix(get_V_k_permutation(U.size(), k));
 }
 
-// W_k
+// W_k (dense)
 template <typename T>
 vector<vector<double>> get_W_k(vector<vector<T>> U, int k)
 {
-
-    int dimension = U.size();
-    if (k < 1 || k >= dimension)
-    {
-        cerr << "Invalid K for matrix V_k: " << to_string(k) << ". Choose k to be between 1 and " << to_string(dimension) << endl;
-        exit(1);
-    }
-
-    int dimensionSq = pow(dimension, 2);
-    vector<vector<double>> W_k(dimensionSq, vector<double>(dimensionSq));
-
-    int W_row = 0;
-    // Get matrix of ones at position 0
-    vector<vector<double>> one_matrix = get_matrix_of_ones(0, U);
-    int offset = k * dimension;
-
-    // Divide the W matrix into several blocks of size dxd and store matrix of ones in them with offsets
-    for (int i = 0; i < dimension; i++)
-    {
-        // Loop over the matrix of ones
-        for (int one_matrix_index = 0; one_matrix_index < dimension; one_matrix_index++)
-        {
-            // Pad with zeros the vector of one
-            vector<double> temp_fill = pad_zero(offset, one_matrix[one_matrix_index]);
-            // Store vector in W_k at position W_row
-            // print_full_vector(temp_fill);
-            W_k[W_row] = temp_fill;
-            W_row++;
-        }
-        if (offset + dimension == dimensionSq)
-        {
-            offset = 0;
-        }
-        else
-        {
-            offset += dimension;
-        }
-    }
-
-    return W_k;
+    return get_permutation_matrix(get_W_k_permutation(U.size(), k));
 }
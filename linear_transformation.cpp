@@ -161,10 +161,11 @@ Ciphertext Linear_Transform_Plain(Ciphertext ct, vector<Plaintext> U_diagonals,
     vector<Ciphertext> ct_result(U_diagonals.size());
     evaluator.multiply_plain(ct_new, U_diagonals[0], ct_result[0]);
 
+    // Rotate by 1 from the previous diagonal instead of by l from ct_new
+    Ciphertext temp_rot = ct_new;
     for (int l = 1; l < U_diagonals.size(); l++)
     {
-        Ciphertext temp_rot;
-        evaluator.rotate_vector(ct_new, l, gal_keys, temp_rot);
+        evaluator.rotate_vector_inplace(temp_rot, 1, gal_keys);
         evaluator.multiply_plain(temp_rot, U_diagonals[l], ct_result[l]);
     }
     Ciphertext ct_prime;
@@ -188,10 +189,11 @@ Ciphertext Linear_Transform_Cipher(Ciphertext ct, vector<Ciphertext> U_diagonals
     vector<Ciphertext> ct_result(U_diagonals.size());
     evaluator.multiply(ct_new, U_diagonals[0], ct_result[0]);
 
+    // Rotate by 1 from the previous diagonal instead of by l from ct_new
+    Ciphertext temp_rot = ct_new;
     for (int l = 1; l < U_diagonals.size(); l++)
     {
-        Ciphertext temp_rot;
-        evaluator.rotate_vector(ct_new, l, gal_keys, temp_rot);
+        evaluator.rotate_vector_inplace(temp_rot, 1, gal_keys);
         evaluator.multiply(temp_rot, U_diagonals[l], ct_result[l]);
     }
     Ciphertext ct_prime;
@@ -229,7 +231,8 @@ void Matrix_Vector_Multiplication(size_t poly_modulus_degree)
     KeyGenerator keygen(context);
     PublicKey pk = keygen.public_key();
     SecretKey sk = keygen.secret_key();
-    GaloisKeys gal_keys = keygen.galois_keys();
+    // The linear transformations below rotate by 1 and by -dimension (dimensions 10, 100 and 1000), only these Galois keys are generated
+    GaloisKeys gal_keys = keygen.galois_keys(vector<int>{1, -10, -100, -1000});
 
     Encryptor encryptor(context, pk);
     Evaluator evaluator(context);
@@ -2,204 +2,11 @@
 #include <iomanip>
 #include <fstream>
 #include "seal/seal.h"
+#include "helper.h"
 
 using namespace std;
 using namespace seal;
 
-// Helper function that prints a matrix (vector of vectors)
-template <typename T>
-inline void print_full_matrix(vector<vector<T>> matrix, int precision = 3)
-{
-    // save formatting for cout
-    ios old_fmt(nullptr);
-    old_fmt.copyfmt(cout);
-    cout << fixed << setprecision(precision);
-    int row_size = matrix.size();
-    int col_size = matrix[0].size();
-    for (unsigned int i = 0; i < row_size; i++)
-    {
-        cout << "[";
-        for (unsigned int j = 0; j < col_size - 1; j++)
-        {
-            cout << matrix[i][j] << ", ";
-        }
-        cout << matrix[i][col_size - 1];
-        cout << "]" << endl;
-    }
-    cout << endl;
-    // restore old cout formatting
-    cout.copyfmt(old_fmt);
-}
-
-// Helper function that prints parts of a matrix (only squared matrix)
-template <typename T>
-inline void print_partial_matrix(vector<vector<T>> matrix, int print_size = 3, int precision = 3)
-{
-    // save formatting for cout
-    ios old_fmt(nullptr);
-    old_fmt.copyfmt(cout);
-    cout << fixed << setprecision(precision);
-
-    int row_size = matrix.size();
-    int col_size = matrix[0].size();
-
-    // Boundary check
-    if (row_size < 2 * print_size && col_size < 2 * print_size)
-    {
-        cerr << "Cannot print matrix with these dimensions: " << to_string(row_size) << "x" << to_string(col_size) << ". Increase the print size" << endl;
-        return;
-    }
-    // print first 4 elements
-    for (unsigned int row = 0; row < print_size; row++)
-    {
-        cout << "\t[";
-        for (unsigned int col = 0; col < print_size; col++)
-        {
-            cout << matrix[row][col] << ", ";
-        }
-        cout << "..., ";
-        for (unsigned int col = col_size - print_size; col < col_size - 1; col++)
-        {
-            cout << matrix[row][col] << ", ";
-        }
-        cout << matrix[row][col_size - 1];
-        cout << "]" << endl;
-    }
-    cout << "\t..." << endl;
-
-    for (unsigned int row = row_size - print_size; row < row_size; row++)
-    {
-        cout << "\t[";
-        for (unsigned int col = 0; col < print_size; col++)
-        {
-            cout << matrix[row][col] << ", ";
-        }
-        cout << "..., ";
-        for (unsigned int col = col_size - print_size; col < col_size - 1; col++)
-        {
-            cout << matrix[row][col] << ", ";
-        }
-        cout << matrix[row][col_size - 1];
-        cout << "]" << endl;
-    }
-
-    cout << endl;
-    // restore old cout formatting
-    cout.copyfmt(old_fmt);
-}
-
-template <typename T>
-inline void print_partial_vector(vector<T> vec, int size, int print_size = 3, int precision = 3)
-{
-    // save formatting for cout
-    ios old_fmt(nullptr);
-    old_fmt.copyfmt(cout);
-    cout << fixed << setprecision(precision);
-
-    int row_size = size;
-
-    // Boundary check
-    if (row_size < 2 * print_size)
-    {
-        cerr << "Cannot print vector with these dimensions: " << to_string(row_size) << ". Increase the print size" << endl;
-        return;
-    }
-
-    cout << "\t[";
-    for (unsigned int row = 0; row < print_size; row++)
-    {
-        cout << vec[row] << ", ";
-    }
-    cout << "..., ";
-
-    for (unsigned int row = row_size - print_size; row < row_size - 1; row++)
-    {
-        cout << vec[row] << ", ";
-    }
-    cout << vec[row_size - 1] << "]\n";
-
-    cout << endl;
-    // restore old cout formatting
-    cout.copyfmt(old_fmt);
-}
-
-// Gets a diagonal from a matrix U
-template <typename T>
-vector<T> get_diagonal(int position, vector<vector<T>> U)
-{
-
-    vector<T> diagonal(U.size());
-
-    int k = 0;
-    // U(0,l) , U(1,l+1), ... ,  U(n-l-1, n-1)
-    for (int i = 0, j = position; (i < U.size() - position) && (j < U.size()); i++, j++)
-    {
-        diagonal[k] = U[i][j];
-        k++;
-    }
-    for (int i = U.size() - position, j = 0; (i < U.size()) && (j < position); i++, j++)
-    {
-        diagonal[k] = U[i][j];
-        k++;
-    }
-
-    return diagonal;
-}
-
-Ciphertext Linear_Transform_Plain(Ciphertext ct, vector<Plaintext> U_diagonals, GaloisKeys gal_keys, EncryptionParameters params)
-{
-    auto context = SEALContext::Create(params);
-    Evaluator evaluator(context);
-
-    // Fill ct with duplicate
-    Ciphertext ct_rot;
-    evaluator.rotate_vector(ct, -U_diagonals.size(), gal_keys, ct_rot);
-    // cout << "U_diagonals.size() = " << U_diagonals.size() << endl;
-    Ciphertext ct_new;
-    evaluator.add(ct, ct_rot, ct_new);
-
-    vector<Ciphertext> ct_result(U_diagonals.size());
-    evaluator.multiply_plain(ct_new, U_diagonals[0], ct_result[0]);
-
-    for (int l = 1; l < U_diagonals.size(); l++)
-    {
-        Ciphertext temp_rot;
-        evaluator.rotate_vector(ct_new, l, gal_keys, temp_rot);
-        evaluator.multiply_plain(temp_rot, U_diagonals[l], ct_result[l]);
-    }
-    Ciphertext ct_prime;
-    evaluator.add_many(ct_result, ct_prime);
-
-    return ct_prime;
-}
-
-Ciphertext Linear_Transform_Cipher(Ciphertext ct, vector<Ciphertext> U_diagonals, GaloisKeys gal_keys, EncryptionParameters params)
-{
-    auto context = SEALContext::Create(params);
-    Evaluator evaluator(context);
-
-    // Fill ct with duplicate
-    Ciphertext ct_rot;
-    evaluator.rotate_vector(ct, -U_diagonals.size(), gal_keys, ct_rot);
-    // cout << "U_diagonals.size() = " << U_diagonals.size() << endl;
-    Ciphertext ct_new;
-    evaluator.add(ct, ct_rot, ct_new);
-
-    vector<Ciphertext> ct_result(U_diagonals.size());
-    evaluator.multiply(ct_new, U_diagonals[0], ct_result[0]);
-
-    for (int l = 1; l < U_diagonals.size(); l++)
-    {
-        Ciphertext temp_rot;
-        evaluator.rotate_vector(ct_new, l, gal_keys, temp_rot);
-        evaluator.multiply(temp_rot, U_diagonals[l], ct_result[l]);
-    }
-    Ciphertext ct_prime;
-    evaluator.add_many(ct_result, ct_prime);
-
-    return ct_prime;
-}
-
 void test_Linear_Transformation(int dimension, vector<vector<double>> input_matrix, vector<double> input_vec)
 {
     vector<double> result(dimension);
@@ -230,24 +37,27 @@ void PMatrix_CVector_Multiplication(size_t poly_modulus_degree, int dimension)
     params.set_poly_modulus_degree(poly_modulus_degree);
     cout << "MAX BIT COUNT: " << CoeffModulus::MaxBitCount(poly_modulus_degree) << endl;
     params.set_coeff_modulus(CoeffModulus::Create(poly_modulus_degree, {60, 40, 40, 60}));
-    auto context = SEALContext::Create(params);
-
-    // Generate keys, encryptor, decryptor and evaluator
-    KeyGenerator keygen(context);
-    PublicKey pk = keygen.public_key();
-    SecretKey sk = keygen.secret_key();
-    GaloisKeys gal_keys = keygen.galois_keys();
-
-    Encryptor encryptor(context, pk);
-    Evaluator evaluator(context);
-    Decryptor decryptor(context, sk);
 
-    // Create CKKS encoder
-    CKKSEncoder ckks_encoder(context);
     // Create scale
     cout << "Coeff Modulus Back Value: " << params.coeff_modulus().back().value() << endl;
     double scale = pow(2.0, 40);
 
+    // Rotation steps of the plain and cipher transforms and of their BSGS versions, only their Galois keys are generated
+    RotationPlan plan(poly_modulus_degree / 2);
+    Plan_Linear_Transform_Plain(plan, dimension);
+    Plan_Linear_Transform_Cipher(plan, dimension);
+    Plan_Linear_Transform_BSGS(plan, dimension);
+    Plan_BSGS_Rotate_Diagonals(plan, dimension);
+
+    // Create the HE session (context, keys, encryptor, evaluator, decryptor and encoder)
+    HESession session(params, scale, 1, Plan_Galois_Steps(plan));
+    GaloisKeys &gal_keys = session.gal_keys;
+    RelinKeys &relin_keys = session.relin_keys;
+    Encryptor &encryptor = session.encryptor;
+    Evaluator &evaluator = session.evaluator;
+    Decryptor &decryptor = session.decryptor;
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
+
     // Set output file
     string filename = "linear_transf_p" + to_string(poly_modulus_degree) + "_d" + to_string(dimension) + ".dat";
     ofstream outf(filename);
@@ -361,7 +171,7 @@ void PMatrix_CVector_Multiplication(size_t poly_modulus_degree, int dimension)
 
     // Test LinearTransform here
     auto start_comp1_set1 = chrono::high_resolution_clock::now();
-    Ciphertext ct_prime1_set1 = Linear_Transform_Plain(cipher_matrix_set1[0], plain_diagonal_set1, gal_keys, params);
+    Ciphertext ct_prime1_set1 = Linear_Transform_Plain(cipher_matrix_set1[0], plain_diagonal_set1, session);
     auto stop_comp1_set1 = chrono::high_resolution_clock::now();
 
     auto duration_comp1_set1 = chrono::duration_cast<chrono::microseconds>(stop_comp1_set1 - start_comp1_set1);
@@ -395,6 +205,29 @@ void PMatrix_CVector_Multiplication(size_t poly_modulus_degree, int dimension)
 
     test_Linear_Transformation(dimension, pod_matrix_set1, pod_matrix_set1[0]);
 
+    // ------------- BSGS CHECK ----------------
+    // The BSGS transforms (on diagonals pre-rotated offline) must match the diagonal method, for plain and encrypted diagonals
+    Ciphertext ct_plain_bsgs = Linear_Transform_Plain_BSGS(cipher_matrix_set1[0], BSGS_Rotate_Diagonals(plain_diagonal_set1, ckks_encoder), session);
+    Ciphertext ct_cipher = Linear_Transform_Cipher(cipher_matrix_set1[0], cipher_diagonal_set1, gal_keys, evaluator);
+    Ciphertext ct_cipher_bsgs = Linear_Transform_Cipher_BSGS(cipher_matrix_set1[0], BSGS_Rotate_Diagonals(cipher_diagonal_set1, gal_keys, evaluator), gal_keys, relin_keys, evaluator);
+
+    auto max_difference = [&](const Ciphertext &ct_a, const Ciphertext &ct_b) {
+        Plaintext pt_a, pt_b;
+        vector<double> a, b;
+        decryptor.decrypt(ct_a, pt_a);
+        decryptor.decrypt(ct_b, pt_b);
+        ckks_encoder.decode(pt_a, a);
+        ckks_encoder.decode(pt_b, b);
+        double difference = 0;
+        for (int i = 0; i < dimension; i++)
+        {
+            difference = max(difference, abs(a[i] - b[i]));
+        }
+        return difference;
+    };
+    cout << "\nMax difference C_Vec . P_Mat BSGS:\t" << max_difference(ct_prime1_set1, ct_plain_bsgs) << endl;
+    cout << "Max difference C_Vec . C_Mat BSGS:\t" << max_difference(ct_cipher, ct_cipher_bsgs) << endl;
+
     outf << "\n"
          << endl;
     outf.close();
@@ -7,11 +7,6 @@
 using namespace std;
 using namespace seal;
 
-#define POLY_MOD_DEGREE 16384
-#define DEGREE 3
-#define ITERS 10
-#define LEARNING_RATE 0.1
-
 template <typename T>
 vector<T> rotate_vec(vector<T> input_vec, int num_rotations)
 {
@@ -30,7 +25,7 @@ vector<T> rotate_vec(vector<T> input_vec, int num_rotations)
     return rotated_res;
 }
 
-void print_Ciphertext_Info(string ctx_name, Ciphertext ctx, shared_ptr<SEALContext> context)
+void print_Ciphertext_Info(const string &ctx_name, const Ciphertext &ctx, const shared_ptr<SEALContext> &context)
 {
     cout << "/" << endl;
     cout << "| " << ctx_name << " Info:" << endl;
@@ -51,22 +46,53 @@ float sigmoid(float z)
     return 1 / (1 + exp(-z));
 }
 
+// Coefficients of the sigmoid approximation (polynomial in x / 8) of the given degree
+// Apart from the constant they are odd, the even coefficients are exactly 0 (PS_cipher then only computes powers of x^2)
+vector<double> sigmoid_coeffs(int degree)
+{
+    vector<double> coeffs;
+    if (degree == 3)
+    {
+        coeffs = {0.5, 1.20069, 0, -0.81562};
+    }
+    else if (degree == 5)
+    {
+        coeffs = {0.5, 1.53048, 0, -2.3533056, 0, 1.3511295};
+    }
+    else if (degree == 7)
+    {
+        coeffs = {0.5, 1.73496, 0, -4.19407, 0, 5.43402, 0, -2.50739};
+    }
+    else
+    {
+        cerr << "Invalid degree" << endl;
+        exit(EXIT_FAILURE);
+    }
+    return coeffs;
+}
+
 // Tree Method
-Ciphertext Tree_cipher(Ciphertext ctx, int degree, double scale, vector<double> coeffs, CKKSEncoder &ckks_encoder, Evaluator &evaluator, Encryptor &encryptor, RelinKeys relin_keys, EncryptionParameters params)
+Ciphertext Tree_cipher(const Ciphertext &ctx, int degree, const vector<double> &coeffs, HESession &session)
 {
     cout << "->" << __func__ << endl;
 
-    auto context = SEALContext::Create(params);
+    auto context = session.context;
+    double scale = session.scale;
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
+    Evaluator &evaluator = session.evaluator;
+    Encryptor &encryptor = session.encryptor;
+    RelinKeys &relin_keys = session.relin_keys;
 
     // Print Ciphertext Information
     print_Ciphertext_Info("CTX", ctx, context);
 
     int depth = ceil(log2(degree));
 
-    // Form the polynomial
+    // Form the polynomial (coefficient i is encoded once the level and scale of x^i are known)
+    // Only the powers of the non-zero terms are needed
     vector<Plaintext> plain_coeffs(degree + 1);
+    set<int> exponents;
     cout << "Polynomial = ";
-    int counter = 0;
     for (size_t i = 0; i < degree + 1; i++)
     {
         // cout << "-> " << __LINE__ << endl;
@@ -74,10 +100,12 @@ Ciphertext Tree_cipher(Ciphertext ctx, int degree, double scale, vector<double>
         {
             continue;
         }
-        ckks_encoder.encode(coeffs[i], scale, plain_coeffs[i]);
-        cout << "x^" << counter << " * (" << coeffs[i] << ")"
+        cout << "x^" << i << " * (" << coeffs[i] << ")"
              << ", ";
-        counter++;
+        if (i > 0)
+        {
+            exponents.insert(i);
+        }
     }
     cout << endl;
 
@@ -86,10 +114,10 @@ Ciphertext Tree_cipher(Ciphertext ctx, int degree, double scale, vector<double>
 
     double expected_result = coeffs[degree];
 
-    // Compute all powers
-    vector<Ciphertext> powers(degree + 1);
-    compute_all_powers(ctx, degree, evaluator, relin_keys, powers);
-    cout << "All powers computed " << endl;
+    // Compute the powers of the non-zero terms (and the intermediate powers they need) at minimum depth
+    vector<Ciphertext> powers;
+    compute_powers(ctx, exponents, session, powers);
+    cout << "Powers computed " << endl;
 
     // Print Ciphertext Information
     print_Ciphertext_Info("CTX", ctx, context);
@@ -97,6 +125,7 @@ Ciphertext Tree_cipher(Ciphertext ctx, int degree, double scale, vector<double>
     // Encrypt First Coefficient
     Ciphertext enc_result;
     cout << "Encrypt first coeff...";
+    ckks_encoder.encode(coeffs[0], scale, plain_coeffs[0]);
     encryptor.encrypt(plain_coeffs[0], enc_result);
     cout << "Done" << endl;
 
@@ -105,11 +134,12 @@ Ciphertext Tree_cipher(Ciphertext ctx, int degree, double scale, vector<double>
 
     Ciphertext temp;
 
-    for (int i = 1; i <= degree; i++)
+    for (int i : exponents)
     {
         // cout << "-> " << __LINE__ << endl;
 
-        evaluator.mod_switch_to_inplace(plain_coeffs[i], powers[i].parms_id());
+        // Encode coefficient i at the level of x^i and at the scale that brings coeffs[i] * x^i exactly to scale after the rescale
+        ckks_encoder.encode(coeffs[i], powers[i].parms_id(), Target_Plain_Scale(context, powers[i], scale), plain_coeffs[i]);
         // cout << "-> " << __LINE__ << endl;
 
         evaluator.multiply_plain(powers[i], plain_coeffs[i], temp);
@@ -118,12 +148,7 @@ Ciphertext Tree_cipher(Ciphertext ctx, int degree, double scale, vector<double>
         evaluator.rescale_to_next_inplace(temp);
         // cout << "-> " << __LINE__ << endl;
 
-        evaluator.mod_switch_to_inplace(enc_result, temp.parms_id());
-        // cout << "-> " << __LINE__ << endl;
-
-        // Manual Rescale
-        enc_result.scale() = pow(2.0, (int)log2(enc_result.scale()));
-        temp.scale() = pow(2.0, (int)log2(enc_result.scale()));
+        Match_Levels_inplace(enc_result, temp, session);
         // cout << "-> " << __LINE__ << endl;
 
         evaluator.add_inplace(enc_result, temp);
@@ -135,9 +160,15 @@ Ciphertext Tree_cipher(Ciphertext ctx, int degree, double scale, vector<double>
     return enc_result;
 }
 
-Ciphertext Horner_cipher(Ciphertext ctx, int degree, vector<double> coeffs, CKKSEncoder &ckks_encoder, double scale, Evaluator &evaluator, Encryptor &encryptor, RelinKeys relin_keys, EncryptionParameters params)
+// ctx is mod switched along the evaluation, it is taken by value so callers done with it can move it in
+Ciphertext Horner_cipher(Ciphertext ctx, int degree, const vector<double> &coeffs, HESession &session)
 {
-    auto context = SEALContext::Create(params);
+    auto context = session.context;
+    double scale = session.scale;
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
+    Evaluator &evaluator = session.evaluator;
+    Encryptor &encryptor = session.encryptor;
+    RelinKeys &relin_keys = session.relin_keys;
 
     cout << "->" << __func__ << endl;
     cout << "->" << __LINE__ << endl;
@@ -152,7 +183,6 @@ Ciphertext Horner_cipher(Ciphertext ctx, int degree, vector<double> coeffs, CKKS
     for (size_t i = 0; i < degree + 1; i++)
     {
         // coeffs[i] = (double)rand() / RAND_MAX;
-        ckks_encoder.encode(coeffs[i], scale, plain_coeffs[i]);
         cout << "x^" << counter << " * (" << coeffs[i] << ")"
              << ", ";
         counter++;
@@ -160,6 +190,17 @@ Ciphertext Horner_cipher(Ciphertext ctx, int degree, vector<double> coeffs, CKKS
     cout << endl;
     // cout << "->" << __LINE__ << endl;
 
+    // Every step multiplies the scale by ctx.scale() / q, q the last prime of the level of the step (starting at the level of ctx),
+    // so the leading coefficient is encoded at the scale that makes the result land exactly on scale
+    double leading_scale = scale;
+    parms_id_type step_parms_id = ctx.parms_id();
+    for (int i = 0; i < degree; i++)
+    {
+        leading_scale *= Prime_Scale(context, step_parms_id) / ctx.scale();
+        step_parms_id = Next_Parms_Id(context, step_parms_id);
+    }
+    ckks_encoder.encode(coeffs[degree], leading_scale, plain_coeffs[degree]);
+
     Ciphertext temp;
     encryptor.encrypt(plain_coeffs[degree], temp);
 
@@ -187,10 +228,8 @@ Ciphertext Horner_cipher(Ciphertext ctx, int degree, vector<double> coeffs, CKKS
         evaluator.rescale_to_next_inplace(temp);
         // cout << "->" << __LINE__ << endl;
 
-        evaluator.mod_switch_to_inplace(plain_coeffs[i], temp.parms_id());
-
-        // Manual rescale
-        temp.scale() = pow(2.0, 40);
+        // Added coefficients are encoded at the exact level and scale of temp
+        ckks_encoder.encode(coeffs[i], temp.parms_id(), temp.scale(), plain_coeffs[i]);
         // cout << "->" << __LINE__ << endl;
 
         evaluator.add_plain_inplace(temp, plain_coeffs[i]);
@@ -202,9 +241,36 @@ Ciphertext Horner_cipher(Ciphertext ctx, int degree, vector<double> coeffs, CKKS
     return temp;
 }
 
+// Paterson-Stockmeyer method: O(sqrt(degree)) ciphertext multiplications and log depth (degree 7 takes 4 levels instead of 7 with Horner)
+Ciphertext PS_cipher(const Ciphertext &ctx, int degree, const vector<double> &coeffs, HESession &session)
+{
+    cout << "->" << __func__ << endl;
+
+    print_Ciphertext_Info("CTX", ctx, session.context);
+
+    cout << "Polynomial = ";
+    for (size_t i = 0; i < degree + 1; i++)
+    {
+        cout << "x^" << i << " * (" << coeffs[i] << ")"
+             << ", ";
+    }
+    cout << endl;
+
+    Ciphertext result = PS_Polynomial(ctx, vector<double>(coeffs.begin(), coeffs.begin() + degree + 1), session);
+
+    print_Ciphertext_Info("result", result, session.context);
+
+    return result;
+}
+
 // Predict Ciphertext Weights
-Ciphertext predict_cipher_weights(vector<Ciphertext> features, Ciphertext weights, int num_weights, double scale, Evaluator &evaluator, CKKSEncoder &ckks_encoder, GaloisKeys gal_keys, RelinKeys relin_keys, Encryptor &encryptor, EncryptionParameters params)
+Ciphertext predict_cipher_weights(const vector<Ciphertext> &features, const Ciphertext &weights, int num_weights, int degree, HESession &session, MaskCache &mask_cache)
 {
+    double scale = session.scale;
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
+    Evaluator &evaluator = session.evaluator;
+    GaloisKeys &gal_keys = session.gal_keys;
+    RelinKeys &relin_keys = session.relin_keys;
     cout << "->" << __func__ << endl;
     cout << "->" << __LINE__ << endl;
 
@@ -212,60 +278,101 @@ Ciphertext predict_cipher_weights(vector<Ciphertext> features, Ciphertext weight
     int num_rows = features.size();
     vector<Ciphertext> results(num_rows);
 
-    for (int i = 0; i < num_rows; i++)
-    {
-        // Dot Product
-        results[i] = cipher_dot_product(features[i], weights, num_weights, relin_keys, gal_keys, evaluator);
-        // Create mask
-        vector<double> mask_vec(num_rows, 0);
-        mask_vec[i] = 1;
-        Plaintext mask_pt;
-        ckks_encoder.encode(mask_vec, scale, mask_pt);
-        // Bring down mask by 1 level since dot product consumed 1 level
-        evaluator.mod_switch_to_next_inplace(mask_pt);
-        // Multiply result with mask
-        evaluator.multiply_plain_inplace(results[i], mask_pt);
-    }
-    // Add all results to ciphertext vec
-    Ciphertext lintransf_vec;
-    evaluator.add_many(results, lintransf_vec);
+    // Rows run in parallel, every thread with its own memory pool
+    parallel_for(num_rows, session.num_threads, [&](int i, int, MemoryPoolHandle &pool) {
+        // Dot Product (the weights may be below the fresh rows, e.g. after a Nesterov step)
+        if (features[i].parms_id() == weights.parms_id())
+        {
+            results[i] = cipher_dot_product(features[i], weights, num_weights, relin_keys, gal_keys, evaluator, false, pool);
+        }
+        else
+        {
+            Ciphertext features_i(pool);
+            evaluator.mod_switch_to(features[i], weights.parms_id(), features_i, pool);
+            results[i] = cipher_dot_product(features_i, weights, num_weights, relin_keys, gal_keys, evaluator, false, pool);
+        }
+        // Multiply result with mask for slot 0 (the dot products are only summed into slot 0), at the scale that rescales back to scale
+        double mask_scale = Target_Plain_Scale(session.context, results[i], scale);
+        evaluator.multiply_plain_inplace(results[i], get_mask(mask_cache, 0, ckks_encoder.slot_count(), results[i].parms_id(), mask_scale, ckks_encoder), pool);
+    });
+    // Move result i to slot i and add all results to ciphertext vec (same order for any number of threads)
+    Ciphertext lintransf_vec = Shift_Sum(move(results), -1, gal_keys, evaluator);
     cout << "->" << __LINE__ << endl;
 
     // Relin
     evaluator.relinearize_inplace(lintransf_vec, relin_keys);
-    // Rescale
+    // Rescale (exactly to scale)
     evaluator.rescale_to_next_inplace(lintransf_vec);
-    // Manual Rescale
-    lintransf_vec.scale() = pow(2, (int)log2(lintransf_vec.scale()));
     cout << "->" << __LINE__ << endl;
     // Sigmoid over result
-    vector<double> coeffs;
-    if (DEGREE == 3)
-    {
-        coeffs = {0.5, 1.20069, 0.00001, -0.81562};
-    }
-    else if (DEGREE == 5)
-    {
-        coeffs = {0.5, 1.53048, 0.00001, -2.3533056, 0.00001, 1.3511295};
-    }
-    else if (DEGREE == 7)
-    {
-        coeffs = {0.5, 1.73496, 0.00001, -4.19407, 0.00001, 5.43402, 0.00001, -2.50739};
-    }
-    else
-    {
-        cerr << "Invalid DEGREE" << endl;
-        exit(EXIT_FAILURE);
-    }
+    vector<double> coeffs = sigmoid_coeffs(degree);
 
-    Ciphertext predict_res = Horner_cipher(lintransf_vec, coeffs.size() - 1, coeffs, ckks_encoder, scale, evaluator, encryptor, relin_keys, params);
+    Ciphertext predict_res = PS_cipher(lintransf_vec, coeffs.size() - 1, coeffs, session);
     cout << "->" << __LINE__ << endl;
     return predict_res;
 }
 
+// Predict Ciphertext Weights (packed rows)
+// Each ciphertext of features_packed holds many rows, row r in slots [r * width, r * width + num_weights) with width = next_power_of_two(num_weights)
+// weights_packed holds the weights repeated in every segment of width slots, the prediction of row r is returned in slot r * width
+vector<Ciphertext> predict_cipher_weights_packed(const vector<Ciphertext> &features_packed, const Ciphertext &weights_packed, int num_weights, int degree, HESession &session)
+{
+    double scale = session.scale;
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
+    Evaluator &evaluator = session.evaluator;
+    GaloisKeys &gal_keys = session.gal_keys;
+    RelinKeys &relin_keys = session.relin_keys;
+    cout << "->" << __func__ << endl;
+    cout << "->" << __LINE__ << endl;
+
+    int width = next_power_of_two(num_weights);
+    vector<double> coeffs = sigmoid_coeffs(degree);
+
+    vector<Ciphertext> predictions(features_packed.size());
+    for (int i = 0; i < features_packed.size(); i++)
+    {
+        // Component-wise multiplication of all rows with the weights (which may be below the fresh rows, e.g. after a Nesterov step)
+        Ciphertext lintransf_vec;
+        if (features_packed[i].parms_id() == weights_packed.parms_id())
+        {
+            evaluator.multiply(features_packed[i], weights_packed, lintransf_vec);
+        }
+        else
+        {
+            evaluator.mod_switch_to(features_packed[i], weights_packed.parms_id(), lintransf_vec);
+            evaluator.multiply_inplace(lintransf_vec, weights_packed);
+        }
+        // Relin
+        evaluator.relinearize_inplace(lintransf_vec, relin_keys);
+        // Rescale
+        evaluator.rescale_to_next_inplace(lintransf_vec);
+        // Sum every segment into its first slot
+        Segment_Rotate_And_Sum_inplace(lintransf_vec, 1, width, gal_keys, evaluator);
+
+        // Sigmoid over result (PS_cipher takes the exact scale of lintransf_vec and returns a result at scale)
+        predictions[i] = PS_cipher(lintransf_vec, coeffs.size() - 1, coeffs, session);
+    }
+    cout << "->" << __LINE__ << endl;
+
+    return predictions;
+}
+
+// Adds the rotations of predict_cipher_weights_packed
+void plan_predict_cipher_weights_packed(RotationPlan &plan, int num_weights)
+{
+    Plan_Segment_Rotate_And_Sum(plan, 1, next_power_of_two(num_weights));
+}
+
 // Update Weights (or Gradient Descent)
-Ciphertext update_weights(vector<Ciphertext> features, vector<Ciphertext> features_T, Ciphertext labels, Ciphertext weights, float learning_rate, Evaluator &evaluator, CKKSEncoder &ckks_encoder, GaloisKeys gal_keys, RelinKeys relin_keys, Encryptor &encryptor, double scale, EncryptionParameters params)
+// learning_rate is the base rate of the run and step the ratio of the rate of this iteration to it: the masks of a step of 1 are cached,
+// the others change every iteration and are only encoded for this call
+Ciphertext update_weights(const vector<Ciphertext> &features, const vector<Ciphertext> &features_T, const Ciphertext &labels, const Ciphertext &weights, float learning_rate, int degree, HESession &session, MaskCache &mask_cache, double step = 1)
 {
+    double scale = session.scale;
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
+    Evaluator &evaluator = session.evaluator;
+    GaloisKeys &gal_keys = session.gal_keys;
+    RelinKeys &relin_keys = session.relin_keys;
 
     cout << "->" << __func__ << endl;
     cout << "->" << __LINE__ << endl;
@@ -277,163 +384,653 @@ Ciphertext update_weights(vector<Ciphertext> features, vector<Ciphertext> featur
     cout << "num weights = " << num_weights << endl;
 
     // Get predictions
-    Ciphertext predictions = predict_cipher_weights(features, weights, num_weights, scale, evaluator, ckks_encoder, gal_keys, relin_keys, encryptor, params);
+    Ciphertext predictions = predict_cipher_weights(features, weights, num_weights, degree, session, mask_cache);
 
     // Calculate Predictions - Labels
     // Mod switch labels
-    evaluator.mod_switch_to_inplace(labels, predictions.parms_id());
+    Ciphertext labels_switched;
+    evaluator.mod_switch_to(labels, predictions.parms_id(), labels_switched);
     Ciphertext pred_labels;
-    evaluator.sub(predictions, labels, pred_labels);
+    evaluator.sub(predictions, labels_switched, pred_labels);
 
     cout << "->" << __LINE__ << endl;
 
     // Calculate Gradient vector (loop over rows and dot product)
 
+    // Multiply by learning_rate/observations (times step), folded into the masks
+    double N = learning_rate * step / num_observations;
+
+    cout << "LR / num_obs = " << N << endl;
+
     vector<Ciphertext> gradient_results(num_weights);
-    for (int i = 0; i < num_weights; i++)
-    {
+    parallel_for(num_weights, session.num_threads, [&](int i, int, MemoryPoolHandle &pool) {
         // Mod switch features T [i]
-        evaluator.mod_switch_to_inplace(features_T[i], pred_labels.parms_id());
-        gradient_results[i] = cipher_dot_product(features_T[i], pred_labels, num_observations, relin_keys, gal_keys, evaluator);
+        Ciphertext features_T_i(pool);
+        evaluator.mod_switch_to(features_T[i], pred_labels.parms_id(), features_T_i, pool);
+        gradient_results[i] = cipher_dot_product(features_T_i, pred_labels, num_observations, relin_keys, gal_keys, evaluator, true, pool);
 
-        // Create mask
-        vector<double> mask_vec(num_weights, 0);
-        mask_vec[i] = 1;
-        Plaintext mask_pt;
-        ckks_encoder.encode(mask_vec, scale, mask_pt);
-
-        // Mod switch mask
-        evaluator.mod_switch_to_inplace(mask_pt, gradient_results[i].parms_id());
-        // Multiply result with mask
-        evaluator.multiply_plain_inplace(gradient_results[i], mask_pt);
-    }
+        // Multiply result with mask (holding N), at the scale that rescales back to scale
+        double mask_scale = Target_Plain_Scale(session.context, gradient_results[i], scale);
+        if (step == 1)
+        {
+            evaluator.multiply_plain_inplace(gradient_results[i], get_mask(mask_cache, i, ckks_encoder.slot_count(), gradient_results[i].parms_id(), mask_scale, ckks_encoder, N), pool);
+        }
+        else
+        {
+            evaluator.multiply_plain_inplace(gradient_results[i], encode_mask(i, ckks_encoder.slot_count(), gradient_results[i].parms_id(), mask_scale, ckks_encoder, N), pool);
+        }
+    });
     cout << "->" << __LINE__ << endl;
 
     // Add all gradient results to gradient
-    Ciphertext gradient;
-    evaluator.add_many(gradient_results, gradient);
+    Ciphertext gradient = add_tree(move(gradient_results), evaluator);
 
     // Relin
     evaluator.relinearize_inplace(gradient, relin_keys);
-    // Rescale
+    // Rescale (exactly to scale)
     evaluator.rescale_to_next_inplace(gradient);
-    // Manual rescale
-    gradient.scale() = pow(2, (int)log2(gradient.scale()));
+    cout << "->" << __LINE__ << endl;
 
-    // Multiply by learning_rate/observations
-    double N = learning_rate / num_observations;
+    // Subtract from weights
+    Ciphertext new_weights;
+    evaluator.mod_switch_to(weights, gradient.parms_id(), new_weights);
+    evaluator.sub_inplace(new_weights, gradient);
 
-    cout << "LR / num_obs = " << N << endl;
+    return new_weights;
+}
+
+// Weight independent operands of update_weights_packed at the levels they are used at: the scaled rows at the level of the gradient products
+// (parms_id) and X^T * labels, times step, at the level of the gradient. step is the ratio of the learning rate of the iteration to the one
+// folded into the scaled rows. They only depend on the features, so train_cipher prepares them while the weights of the previous iteration
+// are being refreshed
+struct PackedIterationInputs
+{
+    parms_id_type parms_id = parms_id_zero;
+    double step = 1;
+    vector<Ciphertext> features_scaled;
+    Ciphertext labels_gradient;
+};
+
+void prepare_packed_iteration(const vector<Ciphertext> &features_packed_scaled, const Ciphertext &labels_gradient, parms_id_type parms_id, double step, HESession &session, PackedIterationInputs &inputs)
+{
+    if (inputs.parms_id == parms_id && inputs.step == step)
+    {
+        return;
+    }
 
-    Plaintext N_pt;
-    ckks_encoder.encode(N, N_pt);
-    // Mod Switch N_pt
-    evaluator.mod_switch_to_inplace(N_pt, gradient.parms_id());
+    if (inputs.parms_id != parms_id)
+    {
+        inputs.features_scaled.resize(features_packed_scaled.size());
+        parallel_for(features_packed_scaled.size(), session.num_threads, [&](int i, int, MemoryPoolHandle &) {
+            session.evaluator.mod_switch_to(features_packed_scaled[i], parms_id, inputs.features_scaled[i]);
+        });
+    }
 
+    // A step other than 1 is applied one level above the gradient (X^T * labels is computed long before the gradient runs out of levels)
+    if (step == 1)
+    {
+        session.evaluator.mod_switch_to(labels_gradient, Next_Parms_Id(session.context, parms_id), inputs.labels_gradient);
+    }
+    else
+    {
+        session.evaluator.mod_switch_to(labels_gradient, parms_id, inputs.labels_gradient);
+        Multiply_Const_Rescale_inplace(inputs.labels_gradient, step, session.scale, session);
+    }
+    inputs.parms_id = parms_id;
+    inputs.step = step;
+}
+
+// Update Weights (packed rows)
+// The gradient is X^T * predictions - X^T * labels: the predictions of each pack are spread over their segments, multiplied with the packed rows
+// and the segments are summed, which leaves the full gradient repeated in every segment (the layout of weights)
+// inputs are prepared here if they are not at the level and step of this iteration yet, step scales the whole gradient
+Ciphertext update_weights_packed(const vector<Ciphertext> &features_packed, const vector<Ciphertext> &features_packed_scaled, const Ciphertext &labels_gradient, PackedIterationInputs &inputs, const Ciphertext &weights, int num_weights, int degree, HESession &session, MaskCache &mask_cache, double step = 1)
+{
+    double scale = session.scale;
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
+    Evaluator &evaluator = session.evaluator;
+    GaloisKeys &gal_keys = session.gal_keys;
+    RelinKeys &relin_keys = session.relin_keys;
+    cout << "->" << __func__ << endl;
     cout << "->" << __LINE__ << endl;
-    evaluator.multiply_plain_inplace(gradient, N_pt); // ERROR HERE: CIPHERTEXT IS TRANSPARENT
+
+    int slot_count = ckks_encoder.slot_count();
+    int width = next_power_of_two(num_weights);
+    int rows_per_pack = slot_count / width;
+
+    // Get predictions (slot r * width of every pack)
+    vector<Ciphertext> predictions = predict_cipher_weights_packed(features_packed, weights, num_weights, degree, session);
+
+    // The masked predictions are brought to the scale whose product with the scaled rows lands exactly on scale after the next rescale
+    auto context = session.context;
+    parms_id_type product_parms_id = Next_Parms_Id(context, predictions[0].parms_id());
+    double spread_scale = scale * Prime_Scale(context, product_parms_id) / features_packed_scaled[0].scale();
+    prepare_packed_iteration(features_packed_scaled, labels_gradient, product_parms_id, step, session, inputs);
+
+    // Mask (holding step) for the first slot of every segment. Every pack is at the same level and scale, so a step other than 1, which
+    // changes every iteration, is encoded once for this call instead of being kept in the cache
+    double mask_scale = Target_Plain_Scale(context, predictions[0], spread_scale);
+    Plaintext step_mask;
+    if (step != 1)
+    {
+        step_mask = encode_mask(0, width, predictions[0].parms_id(), mask_scale, ckks_encoder, step);
+    }
+    const Plaintext &mask = step == 1 ? get_mask(mask_cache, 0, width, predictions[0].parms_id(), mask_scale, ckks_encoder) : step_mask;
+
+    vector<Ciphertext> gradient_results(predictions.size());
+    parallel_for(predictions.size(), session.num_threads, [&](int i, int, MemoryPoolHandle &pool) {
+        // Multiply predictions with the mask
+        evaluator.multiply_plain_inplace(predictions[i], mask, pool);
+        evaluator.rescale_to_next_inplace(predictions[i], pool);
+
+        // Spread every prediction over its segment
+        Segment_Rotate_And_Sum_inplace(predictions[i], -1, width, gal_keys, evaluator, pool);
+
+        // Multiply with the packed rows (scaled by learning_rate / num_observations)
+        evaluator.multiply(predictions[i], inputs.features_scaled[i], gradient_results[i], pool);
+        evaluator.relinearize_inplace(gradient_results[i], relin_keys, pool);
+    });
+    cout << "->" << __LINE__ << endl;
+
+    // Add all packs and sum the segments
+    Ciphertext gradient = add_tree(move(gradient_results), evaluator);
+    evaluator.rescale_to_next_inplace(gradient);
+    Segment_Rotate_And_Sum_inplace(gradient, width, rows_per_pack, gal_keys, evaluator);
+
+    // Subtract X^T * labels (gradient, labels_gradient and weights are all exactly at scale)
+    evaluator.sub_inplace(gradient, inputs.labels_gradient);
 
     // Subtract from weights
     Ciphertext new_weights;
-    evaluator.sub(gradient, weights, new_weights);
-    evaluator.negate_inplace(new_weights);
+    evaluator.mod_switch_to(weights, gradient.parms_id(), new_weights);
+    evaluator.sub_inplace(new_weights, gradient);
 
     return new_weights;
 }
 
+// X_b^T * labels_b scaled by factor (learning_rate / rows of the batch) from the packed rows of a batch and its spread labels
+// (label r in every slot of segment r), repeated in every segment like the packed weights. Full dataset training uses it with the
+// whole dataset as the batch, so no ciphertext ever holds more than a pack of rows
+Ciphertext labels_gradient_batch(const vector<Ciphertext> &features_packed, vector<Ciphertext> labels_spread, double factor, int width, HESession &session)
+{
+    Evaluator &evaluator = session.evaluator;
+    int rows_per_pack = session.ckks_encoder.slot_count() / width;
+
+    // The labels are scaled first, at the scale whose product with the rows lands exactly on scale after the next rescale
+    auto context = session.context;
+    vector<Ciphertext> products(features_packed.size());
+    for (int i = 0; i < features_packed.size(); i++)
+    {
+        parms_id_type product_parms_id = Next_Parms_Id(context, labels_spread[i].parms_id());
+        Multiply_Const_Rescale_inplace(labels_spread[i], factor, Target_Plain_Scale(context, product_parms_id, features_packed[i].scale(), session.scale), session);
+
+        Ciphertext features_i;
+        evaluator.mod_switch_to(features_packed[i], product_parms_id, features_i);
+        evaluator.multiply(features_i, labels_spread[i], products[i]);
+        evaluator.relinearize_inplace(products[i], session.relin_keys);
+    }
+
+    // Add all packs and sum the segments
+    Ciphertext gradient = add_tree(move(products), evaluator);
+    evaluator.rescale_to_next_inplace(gradient);
+    Segment_Rotate_And_Sum_inplace(gradient, width, rows_per_pack, session.gal_keys, evaluator);
+    return gradient;
+}
+
+// Source of the encrypted mini-batches: batch b holds the rows [b * batch_size, (b + 1) * batch_size), one row per ciphertext, and the
+// labels of the batch spread like pack_rows(labels repeated width times) (one ciphertext per pack). A batch is only requested when it is
+// first used, so training can start before the whole dataset is encrypted
+using BatchLoader = function<void(int batch, vector<Ciphertext> &rows, vector<Ciphertext> &labels_spread)>;
+
+// Operands of update_weights_packed for one mini-batch, loaded and packed once and reused by every epoch
+struct MiniBatch
+{
+    bool loaded = false;
+    vector<Ciphertext> features_packed;
+    vector<Ciphertext> features_packed_scaled;
+    Ciphertext labels_gradient;
+    PackedIterationInputs inputs;
+};
+
+void load_mini_batch(const BatchLoader &load_batch, int b, float learning_rate, int num_weights, HESession &session, MiniBatch &batch)
+{
+    if (batch.loaded)
+    {
+        return;
+    }
+
+    vector<Ciphertext> rows;
+    vector<Ciphertext> labels_spread;
+    load_batch(b, rows, labels_spread);
+
+    int width = next_power_of_two(num_weights);
+    batch.features_packed = Pack_Rows(rows, width, session.ckks_encoder.slot_count(), session.gal_keys, session.evaluator);
+
+    // The gradient of a batch is averaged over its own rows
+    double factor = learning_rate / rows.size();
+    batch.features_packed_scaled = batch.features_packed;
+    for (int i = 0; i < batch.features_packed_scaled.size(); i++)
+    {
+        Multiply_Const_Rescale_inplace(batch.features_packed_scaled[i], factor, session.scale, session);
+    }
+    batch.labels_gradient = labels_gradient_batch(batch.features_packed, move(labels_spread), factor, width, session);
+    batch.loaded = true;
+}
+
+// Logs the weights decrypted by the refresh service every 5 iterations
+void print_weights_progress(int i, const vector<double> &new_weights_decoded, int num_weights)
+{
+    if (i % 5 == 0)
+    {
+        cout << "\nIteration:\t" << i << endl;
+
+        // Print weights
+        cout << "Weights:\n\t[";
+        for (int i = 0; i < num_weights; i++)
+        {
+            cout << new_weights_decoded[i] << ", ";
+        }
+        cout << "]" << endl;
+    }
+}
+
+// Step sizes of the training, chosen at runtime. Iteration i uses learning_rate / (1 + decay * i). With nesterov the weights follow
+// Nesterov's accelerated gradient: v_{i+1} = w_i - learning_rate(i) * gradient(w_i) and w_{i+1} = v_{i+1} + momentum(i) * (v_{i+1} - v_i),
+// with a fixed momentum, or the momentum of Nesterov's lambda sequence when momentum < 0. The Nesterov step takes one more level per iteration
+struct TrainingSchedule
+{
+    double learning_rate = 0.1;
+    double decay = 0;
+    bool nesterov = false;
+    double momentum = -1;
+};
+
+double schedule_learning_rate(const TrainingSchedule &schedule, int i)
+{
+    return schedule.learning_rate / (1 + schedule.decay * i);
+}
+
+// lambda_0 = 0, lambda_{k+1} = (1 + sqrt(1 + 4 * lambda_k^2)) / 2 and momentum(i) = (lambda_{i+1} - 1) / lambda_{i+2}
+// (0 for the first iteration, then increasing towards 1)
+double schedule_momentum(const TrainingSchedule &schedule, int i)
+{
+    if (!schedule.nesterov)
+    {
+        return 0;
+    }
+    if (schedule.momentum >= 0)
+    {
+        return schedule.momentum;
+    }
+
+    double lambda = 0;
+    double next_lambda = 1;
+    for (int k = 0; k <= i; k++)
+    {
+        lambda = next_lambda;
+        next_lambda = (1 + sqrt(1 + 4 * lambda * lambda)) / 2;
+    }
+    return (lambda - 1) / next_lambda;
+}
+
+// Nesterov step on the refreshed velocity: velocity_next + momentum * (velocity_next - velocity), one level below the fresh velocities
+// (exactly at scale). The velocities are only combined after the refresh, so each iteration still refreshes a single ciphertext
+Ciphertext nesterov_weights(const Ciphertext &velocity_next, const Ciphertext &velocity, double momentum, HESession &session)
+{
+    Evaluator &evaluator = session.evaluator;
+
+    Ciphertext weights;
+    evaluator.mod_switch_to_next(velocity_next, weights);
+    // A zero constant would leave a transparent ciphertext
+    if (momentum == 0)
+    {
+        return weights;
+    }
+
+    Ciphertext velocity_step;
+    evaluator.sub(velocity_next, velocity, velocity_step);
+    Multiply_Const_Rescale_inplace(velocity_step, momentum, session.scale, session);
+    evaluator.add_inplace(weights, velocity_step);
+    return weights;
+}
+
 // Train model function
-Ciphertext train_cipher(vector<Ciphertext> features, vector<Ciphertext> features_T, Ciphertext labels, Ciphertext weights, float learning_rate, int iters, int observations, int num_weights, Evaluator &evaluator, CKKSEncoder &ckks_encoder, double scale, GaloisKeys gal_keys, RelinKeys relin_keys, Encryptor &encryptor, Decryptor &decryptor, EncryptionParameters params)
+// Unpacked training uses features_T and labels (a column per ciphertext), packed training the labels spread over the segments of the packs
+// (labels_spread, laid out like the mini-batches of BatchLoader)
+Ciphertext train_cipher(const vector<Ciphertext> &features, const vector<Ciphertext> &features_T, const Ciphertext &labels, const vector<Ciphertext> &labels_spread, const Ciphertext &weights, const TrainingSchedule &schedule, int iters, int observations, int num_weights, int degree, bool packed, HESession &session)
 {
+    double scale = session.scale;
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
+    Evaluator &evaluator = session.evaluator;
+    GaloisKeys &gal_keys = session.gal_keys;
+    RelinKeys &relin_keys = session.relin_keys;
     cout << "->" << __func__ << endl;
     cout << "->" << __LINE__ << endl;
 
     // Copy weights to new_weights
     Ciphertext new_weights = weights;
 
+    // Masks are encoded on first use and reused by every iteration
+    MaskCache mask_cache;
+
+    // Weights are refreshed by the key holder (Decrypt and Re-Encrypt), which also logs the progress
+    RefreshService refresh(session, [num_weights](int i, const vector<double> &new_weights_decoded) {
+        print_weights_progress(i, new_weights_decoded, num_weights);
+    });
+    PackedIterationInputs inputs;
+
+    // Packed rows: pack the features and compute X^T * labels once for all iterations
+    int width = next_power_of_two(num_weights);
+    int slot_count = ckks_encoder.slot_count();
+    vector<Ciphertext> features_packed;
+    vector<Ciphertext> features_packed_scaled;
+    Ciphertext labels_gradient;
+    if (packed)
+    {
+        features_packed = Pack_Rows(features, width, slot_count, gal_keys, evaluator);
+
+        // The gradient uses the rows scaled by learning_rate / num_observations (rescaled exactly to scale)
+        features_packed_scaled = features_packed;
+        for (int i = 0; i < features_packed_scaled.size(); i++)
+        {
+            Multiply_Const_Rescale_inplace(features_packed_scaled[i], schedule.learning_rate / observations, scale, session);
+        }
+
+        labels_gradient = labels_gradient_batch(features_packed, labels_spread, schedule.learning_rate / observations, width, session);
+        // Repeat the weights in every segment
+        Segment_Rotate_And_Sum_inplace(new_weights, -width, slot_count / width, gal_keys, evaluator);
+    }
+
+    // Nesterov: the velocity starts at the weights, which start one level down like the weights of every later iteration
+    Ciphertext velocity;
+    if (schedule.nesterov)
+    {
+        velocity = new_weights;
+        evaluator.mod_switch_to_next_inplace(new_weights);
+    }
+
     for (int i = 0; i < iters; i++)
     {
-        // Get new weights
-        new_weights = update_weights(features, features_T, labels, new_weights, learning_rate, evaluator, ckks_encoder, gal_keys, relin_keys, encryptor, scale, params);
+        // Get new weights (the velocity with nesterov)
+        double step = schedule_learning_rate(schedule, i) / schedule.learning_rate;
+        if (packed)
+        {
+            new_weights = update_weights_packed(features_packed, features_packed_scaled, labels_gradient, inputs, new_weights, num_weights, degree, session, mask_cache, step);
+        }
+        else
+        {
+            new_weights = update_weights(features, features_T, labels, new_weights, schedule.learning_rate, degree, session, mask_cache, step);
+        }
 
-        // Refresh weights (Decrypt and Re-Encrypt)
-        Plaintext new_weights_pt;
-        decryptor.decrypt(new_weights, new_weights_pt);
-        vector<double> new_weights_decoded;
-        ckks_encoder.decode(new_weights_pt, new_weights_decoded);
+        // Refresh weights, the inputs of the next iteration are prepared while the refresh is in flight
+        // (with the full dataset and a constant learning rate they are only prepared once, at the level found by the first iteration)
+        Refresh_Send(refresh, new_weights);
+        if (packed && i + 1 < iters)
+        {
+            double next_step = schedule_learning_rate(schedule, i + 1) / schedule.learning_rate;
+            prepare_packed_iteration(features_packed_scaled, labels_gradient, inputs.parms_id, next_step, session, inputs);
+        }
+        Refresh_Receive(refresh, new_weights);
 
-        // Log Progress
-        if (i % 5 == 0)
+        if (schedule.nesterov)
         {
-            cout << "\nIteration:\t" << i << endl;
+            Ciphertext velocity_next = move(new_weights);
+            new_weights = nesterov_weights(velocity_next, velocity, schedule_momentum(schedule, i), session);
+            velocity = move(velocity_next);
+        }
+    }
+    print_refresh_stats(refresh);
 
-            // Print weights
-            cout << "Weights:\n\t[";
-            for (int i = 0; i < num_weights; i++)
-            {
-                cout << new_weights_decoded[i] << ", ";
-            }
-            cout << "]" << endl;
+    return new_weights;
+}
+
+// Mini-batch training (packed rows): iteration i updates the weights with the gradient of batch i % num_batches, for epochs passes over
+// the batches. The next batch is loaded and brought to the level of the iteration while the weights are being refreshed
+Ciphertext train_cipher_minibatch(const BatchLoader &load_batch, int num_batches, const Ciphertext &weights, const TrainingSchedule &schedule, int epochs, int num_weights, int degree, HESession &session)
+{
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
+    Evaluator &evaluator = session.evaluator;
+    cout << "->" << __func__ << endl;
+
+    MaskCache mask_cache;
+    RefreshService refresh(session, [num_weights](int i, const vector<double> &new_weights_decoded) {
+        print_weights_progress(i, new_weights_decoded, num_weights);
+    });
+
+    // Repeat the weights in every segment
+    int width = next_power_of_two(num_weights);
+    int slot_count = ckks_encoder.slot_count();
+    Ciphertext new_weights = weights;
+    Segment_Rotate_And_Sum_inplace(new_weights, -width, slot_count / width, session.gal_keys, evaluator);
+
+    Ciphertext velocity;
+    if (schedule.nesterov)
+    {
+        velocity = new_weights;
+        evaluator.mod_switch_to_next_inplace(new_weights);
+    }
+
+    vector<MiniBatch> batches(num_batches);
+    load_mini_batch(load_batch, 0, schedule.learning_rate, num_weights, session, batches[0]);
+
+    int iters = epochs * num_batches;
+    for (int i = 0; i < iters; i++)
+    {
+        MiniBatch &batch = batches[i % num_batches];
+        double step = schedule_learning_rate(schedule, i) / schedule.learning_rate;
+        new_weights = update_weights_packed(batch.features_packed, batch.features_packed_scaled, batch.labels_gradient, batch.inputs, new_weights, num_weights, degree, session, mask_cache, step);
+
+        // Every iteration uses the same levels, so the next batch is prepared at the level of this one
+        Refresh_Send(refresh, new_weights);
+        if (i + 1 < iters)
+        {
+            MiniBatch &next = batches[(i + 1) % num_batches];
+            double next_step = schedule_learning_rate(schedule, i + 1) / schedule.learning_rate;
+            load_mini_batch(load_batch, (i + 1) % num_batches, schedule.learning_rate, num_weights, session, next);
+            prepare_packed_iteration(next.features_packed_scaled, next.labels_gradient, batch.inputs.parms_id, next_step, session, next.inputs);
         }
+        Refresh_Receive(refresh, new_weights);
 
-        encryptor.encrypt(new_weights_pt, new_weights);
+        if (schedule.nesterov)
+        {
+            Ciphertext velocity_next = move(new_weights);
+            new_weights = nesterov_weights(velocity_next, velocity, schedule_momentum(schedule, i), session);
+            velocity = move(velocity_next);
+        }
     }
+    print_refresh_stats(refresh);
 
     return new_weights;
 }
 
+// Adds the rotations of train_cipher (batch_size = 0) or train_cipher_minibatch
+void plan_train_cipher(RotationPlan &plan, int observations, int num_weights, bool packed, int batch_size = 0)
+{
+    int width = next_power_of_two(num_weights);
+    int rows_per_pack = plan.slot_count / width;
+
+    if (batch_size > 0)
+    {
+        Plan_Pack_Rows(plan, batch_size, width);
+        Plan_Segment_Rotate_And_Sum(plan, -width, rows_per_pack);
+        // update_weights_packed (labels_gradient_batch uses the same segment sum)
+        plan_predict_cipher_weights_packed(plan, num_weights);
+        Plan_Segment_Rotate_And_Sum(plan, -1, width);
+        Plan_Segment_Rotate_And_Sum(plan, width, rows_per_pack);
+    }
+    else if (packed)
+    {
+        Plan_Pack_Rows(plan, observations, width);
+        Plan_Segment_Rotate_And_Sum(plan, -width, rows_per_pack);
+        // update_weights_packed (labels_gradient_batch uses the same segment sum)
+        plan_predict_cipher_weights_packed(plan, num_weights);
+        Plan_Segment_Rotate_And_Sum(plan, -1, width);
+        Plan_Segment_Rotate_And_Sum(plan, width, rows_per_pack);
+    }
+    else
+    {
+        // predict_cipher_weights
+        Plan_Rotate_And_Sum(plan, num_weights, false);
+        Plan_Step(plan, -1);
+        // update_weights
+        Plan_Rotate_And_Sum(plan, observations, true);
+    }
+}
+
+// Levels of a training iteration between two refreshes: the prediction (the linear transformation, the PS sigmoid), the gradient step
+// (one more level without packing, for the products with the transposed features) and the Nesterov step
+int train_iteration_depth(int degree, bool packed, bool nesterov)
+{
+    return PS_Depth(sigmoid_coeffs(degree)) + (packed ? 3 : 4) + (nesterov ? 1 : 0);
+}
+
 // Sigmoid approximation without encryption
-double sigmoid_approx(double x)
+double sigmoid_approx(double x, int degree)
 {
     cout << "->" << __func__ << endl;
     cout << "->" << __LINE__ << endl;
 
     double res;
-    if (DEGREE == 3)
+    if (degree == 3)
     {
         res = 0.5 + (1.20096 * (x / 8)) - (0.81562 * (pow((x / 8), 3)));
     }
-    else if (DEGREE == 5)
+    else if (degree == 5)
     {
         res = 0.5 + (1.53048 * (x / 8)) - (2.3533056 * (pow((x / 8), 3))) + (1.3511295 * (pow((x / 8), 5)));
     }
-    else if (DEGREE == 7)
+    else if (degree == 7)
     {
         res = 0.5 + (1.73496 * (x / 8)) - (4.19407 * (pow((x / 8), 3))) + (5.43402 * (pow((x / 8), 5))) - (2.50739 * (pow((x / 8), 3)));
     }
     else
     {
-        cerr << "Invalid DEGREE" << endl;
+        cerr << "Invalid degree" << endl;
         exit(EXIT_SUCCESS);
     }
     return res;
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    // Runtime configuration (config file and flags, see --help)
+    Config config = Load_Config(argc, argv, {
+        {"dataset", "CSV file with the features and the label of a row per line (default pulsar_stars_copy.csv)"},
+        {"poly_modulus_degree", "smallest poly_modulus_degree to consider (default 0)"},
+        {"coeff_modulus", "comma separated prime bit sizes, the second one is the scale (default planned from depth)"},
+        {"depth", "rescales between two refreshes (default the depth of a training iteration)"},
+        {"precision_bits", "fractional bits kept by the results (default 25)"},
+        {"integer_bits", "integer bits of the results (default 16)"},
+        {"degree", "degree of the sigmoid approximation: 3, 5 or 7 (default 3)"},
+        {"iters", "iterations of full dataset training (default 10)"},
+        {"threads", "threads of the parallel loops (default 8)"},
+        {"packed", "pack many rows per ciphertext (default 1)"},
+        {"batch_size", "rows per mini-batch, 0 trains on the full dataset (default 0)"},
+        {"epochs", "passes over the mini-batches (default 1)"},
+        {"learning_rate", "learning rate of the first iteration (default 0.1)"},
+        {"decay", "iteration i uses learning_rate / (1 + decay * i) (default 0)"},
+        {"nesterov", "Nesterov's accelerated gradient, one more level per iteration (default 0)"},
+        {"momentum", "fixed Nesterov momentum, < 0 follows Nesterov's sequence (default -1)"},
+    });
+    int degree = Config_Int(config, "degree", 3);
+    int iters = Config_Int(config, "iters", 10);
+    int num_threads = Config_Int(config, "threads", 8);
+    bool packed = Config_Bool(config, "packed", true);
+    int batch_size = Config_Int(config, "batch_size", 0);
+    int epochs = Config_Int(config, "epochs", 1);
+
+    // Learning rate and momentum schedule
+    TrainingSchedule schedule;
+    schedule.learning_rate = Config_Double(config, "learning_rate", 0.1);
+    schedule.decay = Config_Double(config, "decay", 0);
+    schedule.nesterov = Config_Bool(config, "nesterov", false);
+    schedule.momentum = Config_Double(config, "momentum", -1);
+
+    // Read File
+    string filename = Config_String(config, "dataset", "pulsar_stars_copy.csv");
+    vector<vector<string>> s_matrix = CSVtoMatrix(filename);
+    vector<vector<double>> f_matrix = stringToDoubleMatrix(s_matrix);
+
+    // Init features, labels and weights
+    // Init features (rows of f_matrix , cols of f_matrix - 1)
+    int rows = f_matrix.size();
+    cout << "\nNumber of rows  = " << rows << endl;
+    int cols = f_matrix[0].size() - 1;
+    cout << "\nNumber of cols  = " << cols << endl;
+
+    vector<vector<double>> features(rows, vector<double>(cols));
+    // Init labels (rows of f_matrix)
+    vector<double> labels(rows);
+    // Init weight vector with zeros (cols of features)
+    vector<double> weights(cols);
+
+    // Fill the features matrix and labels vector
+    for (int i = 0; i < rows; i++)
+    {
+        for (int j = 0; j < cols; j++)
+        {
+            features[i][j] = f_matrix[i][j];
+        }
+        labels[i] = f_matrix[i][cols];
+    }
+
+    // Fill the weights with random numbers (from 1 - 2)
+    for (int i = 0; i < cols; i++)
+    {
+        weights[i] = RandomFloat(-2, 2);
+    }
 
     // Test evaluate sigmoid approx
     EncryptionParameters params(scheme_type::CKKS);
 
-    params.set_poly_modulus_degree(POLY_MOD_DEGREE);
-    params.set_coeff_modulus(CoeffModulus::Create(POLY_MOD_DEGREE, {60, 40, 40, 40, 40, 40, 40, 40, 60}));
-
-    double scale = pow(2.0, 40);
+    // Parameters planned from the depth of a training iteration, with enough slots for a row (packed) or for the fill_prefix sum of a
+    // column of features over the observations (Rotate_And_Sum_inplace needs twice the rows)
+    int depth = Config_Int(config, "depth", train_iteration_depth(degree, packed || batch_size > 0, schedule.nesterov));
+    size_t min_slots = packed || batch_size > 0 ? next_power_of_two(cols) : 2 * rows;
+    if (min_slots > MAX_POLY_MODULUS_DEGREE / 2)
+    {
+        cerr << "Unpacked training needs two slots per row: " << rows << " rows need " << min_slots << " slots but the largest poly_modulus_degree only has "
+             << MAX_POLY_MODULUS_DEGREE / 2 << ", use --packed=1 or --batch_size" << endl;
+        exit(EXIT_FAILURE);
+    }
+    size_t min_poly_modulus_degree = Config_Int(config, "poly_modulus_degree", 0);
+    ParameterPlan parameter_plan;
+    if (!config.values.count("coeff_modulus"))
+    {
+        parameter_plan = Plan_Parameters(depth, Config_Int(config, "precision_bits", 25), Config_Int(config, "integer_bits", 16), min_slots, min_poly_modulus_degree);
+    }
+    else
+    {
+        // An explicit chain keeps its own scale and only needs a secure poly_modulus_degree
+        parameter_plan.bit_sizes = Config_Int_List(config, "coeff_modulus", {});
+        if (parameter_plan.bit_sizes.size() < 3)
+        {
+            cerr << "coeff_modulus needs at least 3 primes" << endl;
+            exit(EXIT_FAILURE);
+        }
+        parameter_plan.scale_bits = parameter_plan.bit_sizes[1];
+        parameter_plan.poly_modulus_degree = Secure_Poly_Modulus_Degree(parameter_plan.bit_sizes, max(min_slots, min_poly_modulus_degree / 2));
+    }
+    size_t poly_modulus_degree = parameter_plan.poly_modulus_degree;
+    cout << "\nDepth = " << parameter_plan.bit_sizes.size() - 2 << ", poly_modulus_degree = " << poly_modulus_degree << ", scale = 2^" << parameter_plan.scale_bits << endl;
 
-    auto context = SEALContext::Create(params);
+    params.set_poly_modulus_degree(poly_modulus_degree);
+    params.set_coeff_modulus(CoeffModulus::Create(poly_modulus_degree, parameter_plan.bit_sizes));
 
-    // Generate keys, encryptor, decryptor and evaluator
-    KeyGenerator keygen(context);
-    PublicKey pk = keygen.public_key();
-    SecretKey sk = keygen.secret_key();
-    GaloisKeys gal_keys = keygen.galois_keys();
-    RelinKeys relin_keys = keygen.relin_keys();
+    double scale = pow(2.0, parameter_plan.scale_bits);
 
-    Encryptor encryptor(context, pk);
-    Evaluator evaluator(context);
-    Decryptor decryptor(context, sk);
+    // Rotation steps of the packed prediction and the training, only their Galois keys are generated
+    RotationPlan plan(poly_modulus_degree / 2);
+    plan_predict_cipher_weights_packed(plan, cols);
+    plan_train_cipher(plan, rows, cols, packed, batch_size);
+    cout << "Galois keys: " << plan.steps.size() << " rotation steps" << endl;
 
-    // Create CKKS encoder
-    CKKSEncoder ckks_encoder(context);
+    // Create the HE session (context, keys, encryptor, evaluator, decryptor and encoder) shared by all routines
+    HESession session(params, scale, num_threads, Plan_Galois_Steps(plan));
+    auto context = session.context;
+    Encryptor &encryptor = session.encryptor;
+    Decryptor &decryptor = session.decryptor;
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
 
     print_parameters(context);
 
@@ -450,24 +1047,7 @@ int main()
     encryptor.encrypt(ptx, ctx);
 
     // Create coeffs (Change with degree)
-    vector<double> coeffs;
-    if (DEGREE == 3)
-    {
-        coeffs = {0.5, 1.20069, 0.00001, -0.81562};
-    }
-    else if (DEGREE == 5)
-    {
-        coeffs = {0.5, 1.53048, 0.00001, -2.3533056, 0.00001, 1.3511295};
-    }
-    else if (DEGREE == 7)
-    {
-        coeffs = {0.5, 1.73496, 0.00001, -4.19407, 0.00001, 5.43402, 0.00001, -2.50739};
-    }
-    else
-    {
-        cerr << "Invalid DEGREE" << endl;
-        exit(EXIT_FAILURE);
-    }
+    vector<double> coeffs = sigmoid_coeffs(degree);
 
     // Multiply x by 1/8
     double eight = 1 / 8;
@@ -478,8 +1058,9 @@ int main()
     chrono::microseconds time_diff;
     time_start = chrono::high_resolution_clock::now();
 
-    // Ciphertext ct_res_sigmoid = Tree_cipher(ctx, DEGREE, scale, coeffs, ckks_encoder, evaluator, encryptor, relin_keys, params);
-    Ciphertext ct_res_sigmoid = Horner_cipher(ctx, DEGREE, coeffs, ckks_encoder, scale, evaluator, encryptor, relin_keys, params);
+    // Ciphertext ct_res_sigmoid = Tree_cipher(ctx, degree, coeffs, session);
+    // Ciphertext ct_res_sigmoid = Horner_cipher(ctx, degree, coeffs, session);
+    Ciphertext ct_res_sigmoid = PS_cipher(ctx, degree, coeffs, session);
     time_end = chrono::high_resolution_clock::now();
     time_diff = chrono::duration_cast<chrono::microseconds>(time_end - time_start);
     cout << "Polynomial Evaluation Duration:\t" << time_diff.count() << " microseconds" << endl;
@@ -494,7 +1075,7 @@ int main()
     double true_expected_res = sigmoid(x_eight);
 
     // Get expected approximate result
-    double expected_approx_res = sigmoid_approx(x);
+    double expected_approx_res = sigmoid_approx(x, degree);
 
     cout << "Actual Approximate Result =\t\t" << res_sigmoid_vec[0] << endl;
     cout << "Expected Approximate Result =\t\t" << expected_approx_res << endl;
@@ -510,40 +1091,6 @@ int main()
     cout << "\n--------------------------- TEST LR CKKS ---------------------------\n"
          << endl;
 
-    // Read File
-    string filename = "pulsar_stars_copy.csv";
-    vector<vector<string>> s_matrix = CSVtoMatrix(filename);
-    vector<vector<double>> f_matrix = stringToDoubleMatrix(s_matrix);
-
-    // Init features, labels and weights
-    // Init features (rows of f_matrix , cols of f_matrix - 1)
-    int rows = f_matrix.size();
-    cout << "\nNumber of rows  = " << rows << endl;
-    int cols = f_matrix[0].size() - 1;
-    cout << "\nNumber of cols  = " << cols << endl;
-
-    vector<vector<double>> features(rows, vector<double>(cols));
-    // Init labels (rows of f_matrix)
-    vector<double> labels(rows);
-    // Init weight vector with zeros (cols of features)
-    vector<double> weights(cols);
-
-    // Fill the features matrix and labels vector
-    for (int i = 0; i < rows; i++)
-    {
-        for (int j = 0; j < cols; j++)
-        {
-            features[i][j] = f_matrix[i][j];
-        }
-        labels[i] = f_matrix[i][cols];
-    }
-
-    // Fill the weights with random numbers (from 1 - 2)
-    for (int i = 0; i < cols; i++)
-    {
-        weights[i] = RandomFloat(-2, 2);
-    }
-
     // Test print the features and labels
     cout << "\nTesting features\n--------------\n"
          << endl;
@@ -570,8 +1117,15 @@ int main()
     }
     cout << endl;
 
-    // Get tranpose from client
-    vector<vector<double>> features_T = transpose_matrix(features);
+    // Unpacked training reads the transposed features and the labels with a column of rows values per ciphertext. Packed training
+    // never builds them: they would need a slot per row, and its labels are spread over the segments of the packs instead
+    bool unpacked = !packed && batch_size == 0;
+    vector<vector<double>> features_T;
+    if (unpacked)
+    {
+        // Get tranpose from client
+        features_T = transpose_matrix(features);
+    }
 
     // -------------- ENCODING ----------------
     // Encode features
@@ -584,12 +1138,15 @@ int main()
     cout << "Done" << endl;
 
     vector<Plaintext> features_T_pt(features_T.size());
-    cout << "\nENCODING TRANSPOSED FEATURES ...";
-    for (int i = 0; i < features_T.size(); i++)
+    if (unpacked)
     {
-        ckks_encoder.encode(features_T[i], scale, features_T_pt[i]);
+        cout << "\nENCODING TRANSPOSED FEATURES ...";
+        for (int i = 0; i < features_T.size(); i++)
+        {
+            ckks_encoder.encode(features_T[i], scale, features_T_pt[i]);
+        }
+        cout << "Done" << endl;
     }
-    cout << "Done" << endl;
 
     // Encode weights
     Plaintext weights_pt;
@@ -599,9 +1156,12 @@ int main()
 
     // Encode labels
     Plaintext labels_pt;
-    cout << "\nENCODING LABELS...";
-    ckks_encoder.encode(labels, scale, labels_pt);
-    cout << "Done" << endl;
+    if (unpacked)
+    {
+        cout << "\nENCODING LABELS...";
+        ckks_encoder.encode(labels, scale, labels_pt);
+        cout << "Done" << endl;
+    }
 
     // -------------- ENCRYPTING ----------------
     //Encrypt features
@@ -614,12 +1174,15 @@ int main()
     cout << "Done" << endl;
 
     vector<Ciphertext> features_T_ct(features_T.size());
-    cout << "\nENCRYPTING TRANSPOSED FEATURES ...";
-    for (int i = 0; i < features_T.size(); i++)
+    if (unpacked)
     {
-        encryptor.encrypt(features_T_pt[i], features_T_ct[i]);
+        cout << "\nENCRYPTING TRANSPOSED FEATURES ...";
+        for (int i = 0; i < features_T.size(); i++)
+        {
+            encryptor.encrypt(features_T_pt[i], features_T_ct[i]);
+        }
+        cout << "Done" << endl;
     }
-    cout << "Done" << endl;
 
     // Encrypt weights
     Ciphertext weights_ct;
@@ -629,9 +1192,72 @@ int main()
 
     // Encrypt labels
     Ciphertext labels_ct;
-    cout << "\nENCRYPTING LABELS...";
-    encryptor.encrypt(labels_pt, labels_ct);
-    cout << "Done" << endl;
+    if (unpacked)
+    {
+        cout << "\nENCRYPTING LABELS...";
+        encryptor.encrypt(labels_pt, labels_ct);
+        cout << "Done" << endl;
+    }
+
+    // --------------- PACKED PREDICTION ---------------
+    if (packed)
+    {
+        cout << "\nPacked Prediction--------------\n"
+             << endl;
+
+        int slot_count = ckks_encoder.slot_count();
+        int width = next_power_of_two(cols);
+        int rows_per_pack = slot_count / width;
+
+        // Pack the rows of features and repeat the weights in every segment
+        vector<vector<double>> features_packed = pack_rows(features, width, slot_count);
+        vector<vector<double>> weights_packed = pack_rows(vector<vector<double>>(rows_per_pack, weights), width, slot_count);
+
+        cout << "Rows per ciphertext = " << rows_per_pack << endl;
+        cout << "Packed ciphertexts = " << features_packed.size() << endl;
+
+        vector<Ciphertext> features_packed_ct(features_packed.size());
+        cout << "\nENCODING AND ENCRYPTING PACKED FEATURES ...";
+        for (int i = 0; i < features_packed.size(); i++)
+        {
+            Plaintext features_packed_pt;
+            ckks_encoder.encode(features_packed[i], scale, features_packed_pt);
+            encryptor.encrypt(features_packed_pt, features_packed_ct[i]);
+        }
+        cout << "Done" << endl;
+
+        Plaintext weights_packed_pt;
+        ckks_encoder.encode(weights_packed[0], scale, weights_packed_pt);
+        Ciphertext weights_packed_ct;
+        encryptor.encrypt(weights_packed_pt, weights_packed_ct);
+
+        time_start = chrono::high_resolution_clock::now();
+        vector<Ciphertext> predictions_packed = predict_cipher_weights_packed(features_packed_ct, weights_packed_ct, cols, degree, session);
+        time_end = chrono::high_resolution_clock::now();
+        time_diff = chrono::duration_cast<chrono::microseconds>(time_end - time_start);
+        cout << "Packed Prediction Duration:\t" << time_diff.count() << " microseconds" << endl;
+
+        // Decrypt the first pack and compare with the plaintext polynomial
+        Plaintext predictions_pt;
+        decryptor.decrypt(predictions_packed[0], predictions_pt);
+        vector<double> predictions_vec;
+        ckks_encoder.decode(predictions_pt, predictions_vec);
+
+        for (int i = 0; i < 5 && i < rows; i++)
+        {
+            double dot = 0;
+            for (int j = 0; j < cols; j++)
+            {
+                dot += features[i][j] * weights[j];
+            }
+            double expected = 0;
+            for (int k = coeffs.size() - 1; k >= 0; k--)
+            {
+                expected = expected * dot + coeffs[k];
+            }
+            cout << "Row " << i << ":\tActual = " << predictions_vec[i * width] << "\tExpected = " << expected << endl;
+        }
+    }
 
     // --------------- TRAIN ---------------
     cout << "\nTraining--------------\n"
@@ -641,9 +1267,60 @@ int main()
     int num_weights = features[0].size();
 
     Ciphertext predictions;
-    // predictions = predict_cipher_weights(features_ct, weights_ct, num_weights, scale, evaluator, ckks_encoder, gal_keys, relin_keys, encryptor, params);
+    // MaskCache mask_cache;
+    // predictions = predict_cipher_weights(features_ct, weights_ct, num_weights, degree, session, mask_cache);
+
+    // Encrypts the labels of the rows [first, last) spread like pack_rows(labels repeated width times), one ciphertext per pack
+    int width = next_power_of_two(num_weights);
+    int slot_count = ckks_encoder.slot_count();
+    auto encrypt_labels_spread = [&](int first, int last, vector<Ciphertext> &labels_spread_ct) {
+        vector<vector<double>> labels_rows(last - first);
+        for (int i = first; i < last; i++)
+        {
+            labels_rows[i - first] = vector<double>(width, labels[i]);
+        }
+
+        vector<vector<double>> labels_spread = pack_rows(labels_rows, width, slot_count);
+        labels_spread_ct.resize(labels_spread.size());
+        for (int i = 0; i < labels_spread.size(); i++)
+        {
+            Plaintext labels_pt;
+            ckks_encoder.encode(labels_spread[i], scale, labels_pt);
+            encryptor.encrypt(labels_pt, labels_spread_ct[i]);
+        }
+    };
 
-    Ciphertext new_weights = train_cipher(features_ct, features_T_ct, labels_ct, weights_ct, LEARNING_RATE, ITERS, observations, num_weights, evaluator, ckks_encoder, scale, gal_keys, relin_keys, encryptor, decryptor, params);
+    Ciphertext new_weights;
+    if (batch_size > 0)
+    {
+        // Mini-batches of batch_size rows, encrypted by the client when the training first reaches them
+        int num_batches = (observations + batch_size - 1) / batch_size;
+        BatchLoader load_batch = [&](int b, vector<Ciphertext> &rows_ct, vector<Ciphertext> &labels_spread_ct) {
+            int first = b * batch_size;
+            int last = min(observations, first + batch_size);
+
+            rows_ct.resize(last - first);
+            for (int i = first; i < last; i++)
+            {
+                Plaintext row_pt;
+                ckks_encoder.encode(features[i], scale, row_pt);
+                encryptor.encrypt(row_pt, rows_ct[i - first]);
+            }
+            encrypt_labels_spread(first, last, labels_spread_ct);
+        };
+        new_weights = train_cipher_minibatch(load_batch, num_batches, weights_ct, schedule, epochs, num_weights, degree, session);
+    }
+    else
+    {
+        vector<Ciphertext> labels_spread_ct;
+        if (packed)
+        {
+            cout << "\nENCRYPTING SPREAD LABELS...";
+            encrypt_labels_spread(0, observations, labels_spread_ct);
+            cout << "Done" << endl;
+        }
+        new_weights = train_cipher(features_ct, features_T_ct, labels_ct, labels_spread_ct, weights_ct, schedule, iters, observations, num_weights, degree, packed, session);
+    }
 
     return 0;
 }
\ No newline at end of file
@@ -1,7 +1,9 @@
 #include <iostream>
 #include <iomanip>
 #include <fstream>
+#include <sstream>
 #include <unistd.h>
+#include <dirent.h>
 #include "seal/seal.h"
 
 #include "helper.h"
@@ -9,67 +11,6 @@
 using namespace std;
 using namespace seal;
 
-
-Ciphertext CC_Matrix_Multiplication(Ciphertext ctA, Ciphertext ctB, int dimension, vector<Plaintext> U_sigma_diagonals, vector<Plaintext> U_tau_diagonals, vector<vector<Plaintext>> V_diagonals, vector<vector<Plaintext>> W_diagonals, GaloisKeys gal_keys, EncryptionParameters params)
-{
-
-    auto context = SEALContext::Create(params);
-    Evaluator evaluator(context);
-
-    vector<Ciphertext> ctA_result(dimension);
-    vector<Ciphertext> ctB_result(dimension);
-
-    cout << "----------Step 1----------- " << endl;
-    // Step 1-1
-    ctA_result[0] = Linear_Transform_Plain(ctA, U_sigma_diagonals, gal_keys, params);
-
-    // Step 1-2
-    ctB_result[0] = Linear_Transform_Plain(ctB, U_tau_diagonals, gal_keys, params);
-
-    // Step 2
-    cout << "----------Step 2----------- " << endl;
-
-    for (int k = 1; k < dimension; k++)
-    {
-        cout << "Linear Transf at k = " << k;
-        ctA_result[k] = Linear_Transform_Plain(ctA_result[0], V_diagonals[k - 1], gal_keys, params);
-        ctB_result[k] = Linear_Transform_Plain(ctB_result[0], W_diagonals[k - 1], gal_keys, params);
-        cout << "..... Done" << endl;
-    }
-
-    // Step 3
-    cout << "----------Step 3----------- " << endl;
-
-    // Test Rescale
-    cout << "RESCALE--------" << endl;
-    for (int i = 1; i < dimension; i++)
-    {
-        evaluator.rescale_to_next_inplace(ctA_result[i]);
-        evaluator.rescale_to_next_inplace(ctB_result[i]);
-    }
-
-    Ciphertext ctAB;
-    evaluator.multiply(ctA_result[0], ctB_result[0], ctAB);
-    evaluator.mod_switch_to_next_inplace(ctAB);
-
-    // Manual scale set
-    for (int i = 1; i < dimension; i++)
-    {
-        ctA_result[i].scale() = pow(2, (int)log2(ctA_result[i].scale()));
-        ctB_result[i].scale() = pow(2, (int)log2(ctB_result[i].scale()));
-    }
-
-    for (int k = 1; k < dimension; k++)
-    {
-        cout << "Iteration k = " << k << endl;
-        Ciphertext temp_mul;
-        evaluator.multiply(ctA_result[k], ctB_result[k], temp_mul);
-        evaluator.add_inplace(ctAB, temp_mul);
-    }
-
-    return ctAB;
-}
-
 vector<vector<double>> test_matrix_mult(vector<vector<double>> mat_A, vector<vector<double>> mat_B, int dimension)
 {
     vector<vector<double>> mat_res(dimension, vector<double>(dimension));
@@ -87,37 +28,39 @@ vector<vector<double>> test_matrix_mult(vector<vector<double>> mat_A, vector<vec
     return mat_res;
 }
 
-void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
+void Matrix_Multiplication(const ParameterPlan &parameter_plan, int dimension, int num_threads, const string &bank_directory)
 {
+    size_t poly_modulus_degree = parameter_plan.poly_modulus_degree;
 
-    // Handle Rotation Error First
-    if (dimension > poly_modulus_degree / 4)
+    // Handle Rotation Error First: CC_Matrix_Multiplication copies the dimension^2 slots of the matrix into the next dimension^2 slots
+    if (CC_Batch_Stride(dimension) > poly_modulus_degree / 2)
     {
-        cerr << "Dimension is too large. Choose a dimension less than " << poly_modulus_degree / 4 << endl;
+        cerr << "Dimension is too large: " << CC_Batch_Stride(dimension) << " slots are needed but poly_modulus_degree " << poly_modulus_degree << " only has " << poly_modulus_degree / 2 << endl;
         exit(1);
     }
 
     EncryptionParameters params(scheme_type::CKKS);
     params.set_poly_modulus_degree(poly_modulus_degree);
     cout << "MAX BIT COUNT: " << CoeffModulus::MaxBitCount(poly_modulus_degree) << endl;
-    params.set_coeff_modulus(CoeffModulus::Create(poly_modulus_degree, {60, 40, 40, 40, 40, 60}));
-    auto context = SEALContext::Create(params);
-
-    // Generate keys, encryptor, decryptor and evaluator
-    KeyGenerator keygen(context);
-    PublicKey pk = keygen.public_key();
-    SecretKey sk = keygen.secret_key();
-    GaloisKeys gal_keys = keygen.galois_keys();
-
-    Encryptor encryptor(context, pk);
-    Evaluator evaluator(context);
-    Decryptor decryptor(context, sk);
-
-    // Create CKKS encoder
-    CKKSEncoder ckks_encoder(context);
+    params.set_coeff_modulus(CoeffModulus::Create(poly_modulus_degree, parameter_plan.bit_sizes));
 
     // Create Scale
-    double scale = pow(2.0, 40);
+    double scale = pow(2.0, parameter_plan.scale_bits);
+
+    // Rotation steps of the run, only their Galois keys are generated
+    RotationPlan plan(poly_modulus_degree / 2);
+    Plan_C_Matrix_Encode(plan, dimension);
+    Plan_CC_Matrix_Multiplication(plan, dimension);
+    cout << "Galois keys: " << plan.steps.size() << " rotation steps" << endl;
+
+    // Create the HE session (context, keys, encryptor, evaluator, decryptor and encoder) shared by all routines
+    HESession session(params, scale, 1, Plan_Galois_Steps(plan));
+    auto context = session.context;
+    GaloisKeys &gal_keys = session.gal_keys;
+    Encryptor &encryptor = session.encryptor;
+    Evaluator &evaluator = session.evaluator;
+    Decryptor &decryptor = session.decryptor;
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
 
     // Set output script
     string script = "matrix_mult_plot_p" + to_string(poly_modulus_degree) + "_d" + to_string(dimension) + ".py";
@@ -176,137 +119,25 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
 
     int dimensionSq = pow(dimension, 2);
 
-    // Get U_sigma for first matrix
-    vector<vector<double>> U_sigma = get_U_sigma(pod_matrix1_set1);
-    cout << "\nU_sigma:" << endl;
-    print_full_matrix(U_sigma, 0);
-
-    // Get U_tau for second matrix
-    vector<vector<double>> U_tau = get_U_tau(pod_matrix1_set1);
-    cout << "\nU_tau:" << endl;
-    print_full_matrix(U_tau, 0);
-
-    // Get V_k (3D matrix)
-    vector<vector<vector<double>>> V_k(dimension - 1, vector<vector<double>>(dimensionSq, vector<double>(dimensionSq)));
-
-    for (int i = 1; i < dimension; i++)
-    {
-        V_k[i - 1] = get_V_k(pod_matrix1_set1, i);
-        cout << "\nV_" << to_string(i) << ":" << endl;
-        print_full_matrix(V_k[i - 1], 0);
-    }
-
-    // Get W_k (3D matrix)
-    vector<vector<vector<double>>> W_k(dimension - 1, vector<vector<double>>(dimensionSq, vector<double>(dimensionSq)));
-
-    for (int i = 1; i < dimension; i++)
-    {
-        W_k[i - 1] = get_W_k(pod_matrix1_set1, i);
-        cout << "\nW_" << to_string(i) << ":" << endl;
-        print_full_matrix(W_k[i - 1], 0);
-    }
-
-    // Get Diagonals for U_sigma
-    vector<vector<double>> U_sigma_diagonals = get_all_diagonals(U_sigma);
-    cout << "U_sigma Diagonal Matrix:" << endl;
-    print_full_matrix(U_sigma_diagonals, 0);
-
-    // Test ADD EPSILON
-    double epsilon = 0.00000001;
-    for (int i = 0; i < dimensionSq; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            U_sigma_diagonals[i][j] += epsilon;
-        }
-    }
-
-    // Get Diagonals for U_tau
-    vector<vector<double>> U_tau_diagonals = get_all_diagonals(U_tau);
-
-    // Test ADD EPSILON
-    for (int i = 0; i < dimensionSq; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            U_tau_diagonals[i][j] += epsilon;
-        }
-    }
-
-    // Get Diagonals for V_k
-    vector<vector<vector<double>>> V_k_diagonals(dimension - 1, vector<vector<double>>(dimensionSq, vector<double>(dimensionSq)));
-
-    for (int i = 1; i < dimension; i++)
-    {
-        V_k_diagonals[i - 1] = get_all_diagonals(V_k[i - 1]);
-    }
-
-    // Test ADD EPSILON
-    for (int i = 0; i < dimension - 1; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            for (int k = 0; k < dimensionSq; k++)
-            {
-
-                V_k_diagonals[i][j][k] += epsilon;
-            }
-        }
-    }
-
-    // Get Diagonals for W_k
-    vector<vector<vector<double>>> W_k_diagonals(dimension - 1, vector<vector<double>>(dimensionSq, vector<double>(dimensionSq)));
-
-    for (int i = 1; i < dimension; i++)
-    {
-        W_k_diagonals[i - 1] = get_all_diagonals(W_k[i - 1]);
-    }
-
-    // Test ADD EPSILON
-    for (int i = 0; i < dimension - 1; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            for (int k = 0; k < dimensionSq; k++)
-            {
-
-                W_k_diagonals[i][j][k] += epsilon;
-            }
-        }
-    }
-
     // --------------- ENCODING ----------------
-    // Encode U_sigma diagonals
-    // Encode U_tau diagonals
-    vector<Plaintext> U_sigma_diagonals_plain(dimensionSq);
-    vector<Plaintext> U_tau_diagonals_plain(dimensionSq);
-    vector<vector<Plaintext>> V_k_diagonals_plain(dimension - 1, vector<Plaintext>(dimensionSq));
-    vector<vector<Plaintext>> W_k_diagonals_plain(dimension - 1, vector<Plaintext>(dimensionSq));
+    // Diagonal bank of U_sigma, U_tau, V_k and W_k: encoded and saved on the first run for this dimension, parms_id and scale
+    cout << "\nDIAGONAL BANK...." << endl;
+    auto start_bank = chrono::high_resolution_clock::now();
+    unique_ptr<DiagonalBank> bank = Open_Diagonal_Bank(bank_directory, dimension, session);
+    auto stop_bank = chrono::high_resolution_clock::now();
+    auto duration_bank = chrono::duration_cast<chrono::microseconds>(stop_bank - start_bank);
+    cout << "Diagonal Bank Open Duration:\t" << duration_bank.count() << endl;
+
     vector<Plaintext> plain_matrix1_set1(dimension);
     vector<Plaintext> plain_matrix2_set1(dimension);
 
-    // cout << "\nEncoding U_sigma_diagonals...Encoding U_tau_diagonals...";
+    // The diagonals are deserialized from the mapped bank file instead of being encoded
     cout << "\nENCODING...." << endl;
     auto start_encode = chrono::high_resolution_clock::now();
-    for (int i = 0; i < dimensionSq; i++)
-    {
-        ckks_encoder.encode(U_sigma_diagonals[i], scale, U_sigma_diagonals_plain[i]);
-        ckks_encoder.encode(U_tau_diagonals[i], scale, U_tau_diagonals_plain[i]);
-    }
-    // cout << "Done" << endl;
-
-    // Encode V_k diagonals
-    // Encode W_k diagonals
-    // cout << "\nEncoding V_K_diagonals...Encoding W_k_diagonals...";
-    for (int i = 1; i < dimension; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            ckks_encoder.encode(V_k_diagonals[i - 1][j], scale, V_k_diagonals_plain[i - 1][j]);
-            ckks_encoder.encode(W_k_diagonals[i - 1][j], scale, W_k_diagonals_plain[i - 1][j]);
-        }
-    }
-    // cout << "Done" << endl;
+    const vector<Plaintext> &U_sigma_diagonals_plain = Get_Bank_Diagonals(*bank, BANK_U_SIGMA)[0];
+    const vector<Plaintext> &U_tau_diagonals_plain = Get_Bank_Diagonals(*bank, BANK_U_TAU)[0];
+    const vector<vector<Plaintext>> &V_k_diagonals_plain = Get_Bank_Diagonals(*bank, BANK_V_K);
+    const vector<vector<Plaintext>> &W_k_diagonals_plain = Get_Bank_Diagonals(*bank, BANK_W_K);
 
     // Encode Matrices
     // Encode Matrix 1
@@ -359,7 +190,7 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
     // --------------- MATRIX MULTIPLICATION ----------------
     cout << "\nMatrix Multiplication..." << endl;
     auto start_matrix_mult = chrono::high_resolution_clock::now();
-    Ciphertext ct_result = CC_Matrix_Multiplication(cipher_encoded_matrix1_set1, cipher_encoded_matrix2_set1, dimension, U_sigma_diagonals_plain, U_tau_diagonals_plain, V_k_diagonals_plain, W_k_diagonals_plain, gal_keys, params);
+    Ciphertext ct_result = CC_Matrix_Multiplication(cipher_encoded_matrix1_set1, cipher_encoded_matrix2_set1, dimension, U_sigma_diagonals_plain, U_tau_diagonals_plain, V_k_diagonals_plain, W_k_diagonals_plain, session, num_threads);
     auto stop_matrix_mutl = chrono::high_resolution_clock::now();
     auto duration_matrix_mult = chrono::duration_cast<chrono::microseconds>(stop_matrix_mutl - start_matrix_mult);
     cout << "Matrix Mult Duration:\t" << duration_matrix_mult.count() << endl;
@@ -411,10 +242,198 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
     outscript.close();
 }
 
-int main()
+// Compares one CC_Matrix_Multiplication per pair with the batched layout (as many pairs as fit in the slots) for every dimension
+void Batch_Benchmark(const ParameterPlan &parameter_plan, const vector<int> &dimensions, int num_threads, const string &bank_directory)
+{
+    size_t poly_modulus_degree = parameter_plan.poly_modulus_degree;
+    EncryptionParameters params(scheme_type::CKKS);
+    params.set_poly_modulus_degree(poly_modulus_degree);
+    params.set_coeff_modulus(CoeffModulus::Create(poly_modulus_degree, parameter_plan.bit_sizes));
+
+    // Create Scale
+    double scale = pow(2.0, parameter_plan.scale_bits);
+    int slot_count = poly_modulus_degree / 2;
+
+    // Rotation steps of every dimension, only their Galois keys are generated
+    RotationPlan plan(slot_count);
+    for (int dimension : dimensions)
+    {
+        Plan_C_Matrix_Encode(plan, dimension);
+        Plan_CC_Matrix_Multiplication(plan, dimension);
+    }
+
+    // Create the HE session (context, keys, encryptor, evaluator, decryptor and encoder) shared by all dimensions
+    HESession session(params, scale, 1, Plan_Galois_Steps(plan));
+    GaloisKeys &gal_keys = session.gal_keys;
+    Encryptor &encryptor = session.encryptor;
+    Evaluator &evaluator = session.evaluator;
+    Decryptor &decryptor = session.decryptor;
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
+
+    // Encodes, encrypts and matrix encodes the rows of a matrix (or of a batch of matrices)
+    auto encrypt_matrix = [&](const vector<vector<double>> &rows) {
+        vector<Ciphertext> cipher_rows(rows.size());
+        for (int i = 0; i < rows.size(); i++)
+        {
+            Plaintext plain_row;
+            ckks_encoder.encode(rows[i], scale, plain_row);
+            encryptor.encrypt(plain_row, cipher_rows[i]);
+        }
+        return C_Matrix_Encode(cipher_rows, gal_keys, evaluator);
+    };
+
+    vector<string> results;
+    for (int dimension : dimensions)
+    {
+        int batch = CC_Batch_Capacity(dimension, slot_count);
+        if (batch < 1)
+        {
+            cerr << "Dimension is too large for the batch benchmark: " << dimension << endl;
+            continue;
+        }
+
+        // Random pairs of matrices
+        vector<vector<vector<double>>> matrices_A(batch, vector<vector<double>>(dimension, vector<double>(dimension)));
+        vector<vector<vector<double>>> matrices_B(batch, vector<vector<double>>(dimension, vector<double>(dimension)));
+        for (int b = 0; b < batch; b++)
+        {
+            for (int i = 0; i < dimension; i++)
+            {
+                for (int j = 0; j < dimension; j++)
+                {
+                    matrices_A[b][i][j] = ((double)rand() / (RAND_MAX));
+                    matrices_B[b][i][j] = ((double)rand() / (RAND_MAX));
+                }
+            }
+        }
+
+        unique_ptr<DiagonalBank> single_bank = Open_Diagonal_Bank(bank_directory, dimension, session);
+        unique_ptr<DiagonalBank> batch_bank = Open_Diagonal_Bank(bank_directory, dimension, session, batch);
+
+        // Single pair: one call per pair
+        Ciphertext ctA = encrypt_matrix(matrices_A[0]);
+        Ciphertext ctB = encrypt_matrix(matrices_B[0]);
+        auto start_single = chrono::high_resolution_clock::now();
+        CC_Matrix_Multiplication(ctA, ctB, dimension, Get_Bank_Diagonals(*single_bank, BANK_U_SIGMA)[0], Get_Bank_Diagonals(*single_bank, BANK_U_TAU)[0],
+                                 Get_Bank_Diagonals(*single_bank, BANK_V_K), Get_Bank_Diagonals(*single_bank, BANK_W_K), session, num_threads);
+        auto stop_single = chrono::high_resolution_clock::now();
+        auto duration_single = chrono::duration_cast<chrono::microseconds>(stop_single - start_single);
+
+        // Batch: every pair in one call
+        Ciphertext ctA_batch = encrypt_matrix(Batch_Matrix_Rows(matrices_A, slot_count));
+        Ciphertext ctB_batch = encrypt_matrix(Batch_Matrix_Rows(matrices_B, slot_count));
+        auto start_batch = chrono::high_resolution_clock::now();
+        Ciphertext ct_result = CC_Matrix_Multiplication(ctA_batch, ctB_batch, dimension, Get_Bank_Diagonals(*batch_bank, BANK_U_SIGMA)[0], Get_Bank_Diagonals(*batch_bank, BANK_U_TAU)[0],
+                                                        Get_Bank_Diagonals(*batch_bank, BANK_V_K), Get_Bank_Diagonals(*batch_bank, BANK_W_K), session, num_threads);
+        auto stop_batch = chrono::high_resolution_clock::now();
+        auto duration_batch = chrono::duration_cast<chrono::microseconds>(stop_batch - start_batch);
+
+        // Check every product of the batch
+        Plaintext pt_result;
+        decryptor.decrypt(ct_result, pt_result);
+        vector<double> result_slots;
+        ckks_encoder.decode(pt_result, result_slots);
+        vector<vector<vector<double>>> products = Unbatch_Matrices(result_slots, dimension, batch);
+        double max_error = 0;
+        for (int b = 0; b < batch; b++)
+        {
+            vector<vector<double>> expected = test_matrix_mult(matrices_A[b], matrices_B[b], dimension);
+            for (int i = 0; i < dimension; i++)
+            {
+                for (int j = 0; j < dimension; j++)
+                {
+                    max_error = max(max_error, abs(products[b][i][j] - expected[i][j]));
+                }
+            }
+        }
+
+        stringstream result;
+        result << dimension << "\t\t" << batch << "\t" << duration_single.count() << "\t\t\t" << duration_batch.count() / batch << "\t\t\t"
+               << (double)duration_single.count() * batch / duration_batch.count() << "\t" << max_error;
+        results.push_back(result.str());
+    }
+
+    cout << "\nBatched matrix multiplication, poly_modulus_degree = " << poly_modulus_degree << endl;
+    cout << "Dimension\tPairs\tSingle (us/pair)\tBatched (us/pair)\tSpeedup\tMax error" << endl;
+    for (auto &result : results)
+    {
+        cout << result << endl;
+    }
+}
+
+// Removes the diagonal bank files of directory, then the directory itself
+void remove_bank_directory(const string &directory)
 {
+    DIR *dir = opendir(directory.c_str());
+    if (dir)
+    {
+        while (dirent *entry = readdir(dir))
+        {
+            string name = entry->d_name;
+            if (name.size() > 5 && name.compare(name.size() - 5, 5, ".bank") == 0)
+            {
+                remove((directory + "/" + name).c_str());
+            }
+        }
+        closedir(dir);
+    }
+    rmdir(directory.c_str());
+}
 
-    Matrix_Multiplication(8192 * 2, 5);
+int main(int argc, char **argv)
+{
+    // Runtime configuration (config file and flags, see --help)
+    Config config = Load_Config(argc, argv, {
+        {"poly_modulus_degree", "smallest poly modulus degree, set it to compare runs at the same degree (default 0)"},
+        {"precision_bits", "fractional bits kept by the products (default 20)"},
+        {"integer_bits", "integer bits of the products (default 16)"},
+        {"dimension", "dimension of the single product (default 5)"},
+        {"dimensions", "comma separated dimensions of the batch benchmark (default 4,8,16,32,64)"},
+        {"threads", "threads of the parallel loops (default: hardware threads)"},
+        {"bank_directory", "directory that keeps the diagonal bank files between runs (default: a temporary directory removed at exit)"},
+    });
+    size_t min_poly_modulus_degree = Config_Int(config, "poly_modulus_degree", 0);
+    int precision_bits = Config_Int(config, "precision_bits", 20);
+    int integer_bits = Config_Int(config, "integer_bits", 16);
+    int dimension = Config_Int(config, "dimension", 5);
+    vector<int> dimensions = Config_Int_List(config, "dimensions", {4, 8, 16, 32, 64});
+    int num_threads = Config_Int(config, "threads", thread::hardware_concurrency());
+    if (dimensions.empty())
+    {
+        cerr << "dimensions needs at least one dimension" << endl;
+        exit(1);
+    }
+
+    // Smallest parameters for the depth of CC_Matrix_Multiplication with a matrix and its copy per ciphertext, and one chain for every
+    // dimension of the batch benchmark with room for at least one pair of the largest
+    ParameterPlan parameter_plan = Plan_Parameters(CC_Matrix_Multiplication_Depth(), precision_bits, integer_bits, CC_Batch_Stride(dimension), min_poly_modulus_degree);
+    ParameterPlan batch_parameter_plan = Plan_Parameters(CC_Matrix_Multiplication_Depth(), precision_bits, integer_bits, CC_Batch_Stride(*max_element(dimensions.begin(), dimensions.end())), min_poly_modulus_degree);
+
+    // The banks of the batch benchmark take hundreds of MB, by default they only live for the run
+    string bank_directory = Config_String(config, "bank_directory", "");
+    bool temporary = bank_directory.empty();
+    if (temporary)
+    {
+        const char *tmpdir = getenv("TMPDIR");
+        string pattern = string(tmpdir ? tmpdir : "/tmp") + "/diagonal_banks_XXXXXX";
+        vector<char> path(pattern.begin(), pattern.end());
+        path.push_back('\0');
+        if (!mkdtemp(path.data()))
+        {
+            cerr << "Couldn't create a temporary directory: " << pattern << endl;
+            exit(1);
+        }
+        bank_directory = path.data();
+    }
+
+    Matrix_Multiplication(parameter_plan, dimension, num_threads, bank_directory);
+
+    Batch_Benchmark(batch_parameter_plan, dimensions, num_threads, bank_directory);
+
+    if (temporary)
+    {
+        remove_bank_directory(bank_directory);
+    }
 
     return 0;
 }
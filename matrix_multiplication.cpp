@@ -8,160 +8,39 @@
 using namespace std;
 using namespace seal;
 
-Ciphertext CC_Matrix_Multiplication(Ciphertext ctA, Ciphertext ctB, int dimension, vector<Plaintext> U_sigma_diagonals, vector<Plaintext> U_tau_diagonals, vector<vector<Plaintext>> V_diagonals, vector<vector<Plaintext>> W_diagonals, GaloisKeys gal_keys, EncryptionParameters params)
+void Matrix_Multiplication(const ParameterPlan &parameter_plan, int dimension, int num_threads, const string &bank_directory)
 {
+    size_t poly_modulus_degree = parameter_plan.poly_modulus_degree;
 
-    auto context = SEALContext::Create(params);
-    Evaluator evaluator(context);
-
-    vector<Ciphertext> ctA_result(dimension);
-    vector<Ciphertext> ctB_result(dimension);
-
-    cout << "----------Step 1----------- " << endl;
-    // Step 1-1
-    ctA_result[0] = Linear_Transform_Plain(ctA, U_sigma_diagonals, gal_keys, params);
-
-    // Step 1-2
-    ctB_result[0] = Linear_Transform_Plain(ctB, U_tau_diagonals, gal_keys, params);
-
-    /*
-    // Test scale
-    cout << "\nSCALE TEST -----------:" << endl;
-    for (int i = 0; i < dimension; i++)
-    {
-        cout << "CTA scale at i = " << i << ":\t" << log2(ctA_result[i].scale()) << endl;
-        cout << "CTB scale at i = " << i << ":\t" << log2(ctB_result[i].scale()) << endl;
-    }
-*/
-    // Step 2
-    cout << "----------Step 2----------- " << endl;
-
-    for (int k = 1; k < dimension; k++)
-    {
-        cout << "Linear Transf at k = " << k;
-        ctA_result[k] = Linear_Transform_Plain(ctA_result[0], V_diagonals[k - 1], gal_keys, params);
-        ctB_result[k] = Linear_Transform_Plain(ctB_result[0], W_diagonals[k - 1], gal_keys, params);
-        cout << "..... Done" << endl;
-    }
-
-    /*
-    // Test scale
-    for (int i = 0; i < dimension; i++)
-    {
-        cout << "CTA scale at i = " << i << ":\t" << log2(ctA_result[i].scale()) << endl;
-        cout << "CTB scale at i = " << i << ":\t" << log2(ctB_result[i].scale()) << endl;
-    }
-    // Test Chain
-    cout << "\nCHAIN TEST -----------:" << endl;
-    for (int i = 0; i < dimension; i++)
+    // Handle Rotation Error First: CC_Matrix_Multiplication copies the dimension^2 slots of the matrix into the next dimension^2 slots
+    if (CC_Batch_Stride(dimension) > poly_modulus_degree / 2)
     {
-        cout << "chain index A at i = " << i << ":\t" << context->get_context_data(ctA_result[i].parms_id())->chain_index() << endl;
-        cout << "chain index B at i = " << i << ":\t" << context->get_context_data(ctB_result[i].parms_id())->chain_index() << endl;
-    }
-
-    cout << "context data total coeff modulus bit count = " << context->get_context_data(U_sigma_diagonals[0].parms_id())->total_coeff_modulus_bit_count() << endl;
-*/
-    // Step 3
-    cout << "----------Step 3----------- " << endl;
-
-    // Test Rescale
-    cout << "RESCALE--------" << endl;
-    for (int i = 1; i < dimension; i++)
-    {
-        evaluator.rescale_to_next_inplace(ctA_result[i]);
-        evaluator.rescale_to_next_inplace(ctB_result[i]);
-    }
-
-    /*
-    // Test scale
-    for (int i = 0; i < dimension; i++)
-    {
-        cout << "CTA scale at i = " << i << ":\t" << log2(ctA_result[i].scale()) << endl;
-        cout << "CTB scale at i = " << i << ":\t" << log2(ctB_result[i].scale()) << endl;
-    }
-
-    cout << "Exact scale" << endl;
-    ios old_fmt(nullptr);
-    old_fmt.copyfmt(cout);
-    cout << fixed << setprecision(10);
-    for (int i = 0; i < dimension; i++)
-    {
-        cout << "\t Exact scale in ctA at i = " << i << ":\t" << ctA_result[i].scale() << endl;
-        cout << "\t Exact scale in ctB at i = " << i << ":\t" << ctB_result[i].scale() << endl;
-    }
-    cout << endl;
-    cout.copyfmt(old_fmt);
-
-    // Test Chain
-    cout << "\nCHAIN TEST -----------:" << endl;
-    for (int i = 0; i < dimension; i++)
-    {
-        cout << "chain index A at i = " << i << ":\t" << context->get_context_data(ctA_result[i].parms_id())->chain_index() << endl;
-        cout << "chain index B at i = " << i << ":\t" << context->get_context_data(ctB_result[i].parms_id())->chain_index() << endl;
-    }
-*/
-    Ciphertext ctAB;
-    evaluator.multiply(ctA_result[0], ctB_result[0], ctAB);
-
-    // cout << "TEST" << endl;
-    // cout << "CTAB scale :\t" << log2(ctAB.scale()) << endl;
-    // cout << "CTAB chain index :\t" << context->get_context_data(ctAB.parms_id())->chain_index() << endl;
-
-    // Mod switch CTAB
-    // cout << "MOD SWITCH CTAB:" << endl;
-    evaluator.mod_switch_to_next_inplace(ctAB);
-    // cout << "CTAB chain index :\t" << context->get_context_data(ctAB.parms_id())->chain_index() << endl;
-
-    // Manual scale set
-    cout << "\nMANUAL SCALE:" << endl;
-    for (int i = 1; i < dimension; i++)
-    {
-        ctA_result[i].scale() = pow(2, (int)log2(ctA_result[i].scale()));
-        ctB_result[i].scale() = pow(2, (int)log2(ctB_result[i].scale()));
-    }
-
-    for (int k = 1; k < dimension; k++)
-    {
-        cout << "Iteration k = " << k << endl;
-        Ciphertext temp_mul;
-        evaluator.multiply(ctA_result[k], ctB_result[k], temp_mul);
-        evaluator.add_inplace(ctAB, temp_mul);
-    }
-
-    return ctAB;
-}
-
-void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
-{
-
-    // Handle Rotation Error First
-    if (dimension > poly_modulus_degree / 4)
-    {
-        cerr << "Dimension is too large. Choose a dimension less than " << poly_modulus_degree / 4 << endl;
+        cerr << "Dimension is too large: " << CC_Batch_Stride(dimension) << " slots are needed but poly_modulus_degree " << poly_modulus_degree << " only has " << poly_modulus_degree / 2 << endl;
         exit(1);
     }
 
     EncryptionParameters params(scheme_type::CKKS);
     params.set_poly_modulus_degree(poly_modulus_degree);
     cout << "MAX BIT COUNT: " << CoeffModulus::MaxBitCount(poly_modulus_degree) << endl;
-    params.set_coeff_modulus(CoeffModulus::Create(poly_modulus_degree, {60, 40, 40, 40, 40, 60}));
-    auto context = SEALContext::Create(params);
-
-    // Generate keys, encryptor, decryptor and evaluator
-    KeyGenerator keygen(context);
-    PublicKey pk = keygen.public_key();
-    SecretKey sk = keygen.secret_key();
-    GaloisKeys gal_keys = keygen.galois_keys();
-
-    Encryptor encryptor(context, pk);
-    Evaluator evaluator(context);
-    Decryptor decryptor(context, sk);
-
-    // Create CKKS encoder
-    CKKSEncoder ckks_encoder(context);
+    params.set_coeff_modulus(CoeffModulus::Create(poly_modulus_degree, parameter_plan.bit_sizes));
 
     // Create Scale
-    double scale = pow(2.0, 40);
+    double scale = pow(2.0, parameter_plan.scale_bits);
+
+    // Rotation steps of the run, only their Galois keys are generated
+    RotationPlan plan(poly_modulus_degree / 2);
+    Plan_C_Matrix_Encode(plan, dimension);
+    Plan_CC_Matrix_Multiplication(plan, dimension);
+    cout << "Galois keys: " << plan.steps.size() << " rotation steps" << endl;
+
+    // Create the HE session (context, keys, encryptor, evaluator, decryptor and encoder) shared by all routines
+    HESession session(params, scale, 1, Plan_Galois_Steps(plan));
+    auto context = session.context;
+    GaloisKeys &gal_keys = session.gal_keys;
+    Encryptor &encryptor = session.encryptor;
+    Evaluator &evaluator = session.evaluator;
+    Decryptor &decryptor = session.decryptor;
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
 
     vector<vector<double>> pod_matrix1_set1(dimension, vector<double>(dimension));
     vector<vector<double>> pod_matrix2_set1(dimension, vector<double>(dimension));
@@ -200,146 +79,15 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
 
     int dimensionSq = pow(dimension, 2);
 
-    // Get U_sigma for first matrix
-    vector<vector<double>> U_sigma = get_U_sigma(pod_matrix1_set1);
-    cout << "\nU_sigma:" << endl;
-    print_full_matrix(U_sigma, 0);
-
-    // Get U_tau for second matrix
-    vector<vector<double>> U_tau = get_U_tau(pod_matrix1_set1);
-    cout << "\nU_tau:" << endl;
-    print_full_matrix(U_tau, 0);
-
-    // Get V_k (3D matrix)
-    vector<vector<vector<double>>> V_k(dimension - 1, vector<vector<double>>(dimensionSq, vector<double>(dimensionSq)));
-
-    for (int i = 1; i < dimension; i++)
-    {
-        V_k[i - 1] = get_V_k(pod_matrix1_set1, i);
-        cout << "\nV_" << to_string(i) << ":" << endl;
-        print_full_matrix(V_k[i - 1], 0);
-    }
-
-    // Get W_k (3D matrix)
-    vector<vector<vector<double>>> W_k(dimension - 1, vector<vector<double>>(dimensionSq, vector<double>(dimensionSq)));
-
-    for (int i = 1; i < dimension; i++)
-    {
-        W_k[i - 1] = get_W_k(pod_matrix1_set1, i);
-        cout << "\nW_" << to_string(i) << ":" << endl;
-        print_full_matrix(W_k[i - 1], 0);
-    }
-
-    // Get Diagonals for U_sigma
-    vector<vector<double>> U_sigma_diagonals = get_all_diagonals(U_sigma);
-    cout << "U_sigma Diagonal Matrix:" << endl;
-    print_full_matrix(U_sigma_diagonals, 0);
-
-    // Test ADD EPSILON
-    double epsilon = 0.00000001;
-    for (int i = 0; i < dimensionSq; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            U_sigma_diagonals[i][j] += epsilon;
-        }
-    }
-
-    // Get Diagonals for U_tau
-    vector<vector<double>> U_tau_diagonals = get_all_diagonals(U_tau);
-
-    // Test ADD EPSILON
-    for (int i = 0; i < dimensionSq; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            U_tau_diagonals[i][j] += epsilon;
-        }
-    }
-
-    // Get Diagonals for V_k
-    vector<vector<vector<double>>> V_k_diagonals(dimension - 1, vector<vector<double>>(dimensionSq, vector<double>(dimensionSq)));
-
-    for (int i = 1; i < dimension; i++)
-    {
-        V_k_diagonals[i - 1] = get_all_diagonals(V_k[i - 1]);
-    }
-
-    // Test ADD EPSILON
-    for (int i = 0; i < dimension - 1; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            for (int k = 0; k < dimensionSq; k++)
-            {
-
-                V_k_diagonals[i][j][k] += epsilon;
-            }
-        }
-    }
-
-    // Get Diagonals for W_k
-    vector<vector<vector<double>>> W_k_diagonals(dimension - 1, vector<vector<double>>(dimensionSq, vector<double>(dimensionSq)));
-
-    for (int i = 1; i < dimension; i++)
-    {
-        W_k_diagonals[i - 1] = get_all_diagonals(W_k[i - 1]);
-    }
-
-    // Test ADD EPSILON
-    for (int i = 0; i < dimension - 1; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            for (int k = 0; k < dimensionSq; k++)
-            {
-
-                W_k_diagonals[i][j][k] += epsilon;
-            }
-        }
-    }
-
     // --------------- ENCODING ----------------
-    // Encode U_sigma diagonals
-    vector<Plaintext> U_sigma_diagonals_plain(dimensionSq);
-    cout << "\nEncoding U_sigma_diagonals...";
-    for (int i = 0; i < dimensionSq; i++)
-    {
-        ckks_encoder.encode(U_sigma_diagonals[i], scale, U_sigma_diagonals_plain[i]);
-    }
-    cout << "Done" << endl;
-
-    // Encode U_tau diagonals
-    vector<Plaintext> U_tau_diagonals_plain(dimensionSq);
-    cout << "\nEncoding U_tau_diagonals...";
-    for (int i = 0; i < dimensionSq; i++)
-    {
-        ckks_encoder.encode(U_tau_diagonals[i], scale, U_tau_diagonals_plain[i]);
-    }
-    cout << "Done" << endl;
-
-    // Encode V_k diagonals
-    vector<vector<Plaintext>> V_k_diagonals_plain(dimension - 1, vector<Plaintext>(dimensionSq));
-    cout << "\nEncoding V_K_diagonals...";
-    for (int i = 1; i < dimension; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            ckks_encoder.encode(V_k_diagonals[i - 1][j], scale, V_k_diagonals_plain[i - 1][j]);
-        }
-    }
-    cout << "Done" << endl;
-
-    // Encode W_k
-    vector<vector<Plaintext>> W_k_diagonals_plain(dimension - 1, vector<Plaintext>(dimensionSq));
-    cout << "\nEncoding W_k_diagonals...";
-    for (int i = 1; i < dimension; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            ckks_encoder.encode(W_k_diagonals[i - 1][j], scale, W_k_diagonals_plain[i - 1][j]);
-        }
-    }
+    // Load the U_sigma, U_tau, V_k and W_k diagonals (pre-rotated for the BSGS linear transformation) from the diagonal bank,
+    // they are only encoded when no bank file exists for this dimension, parms_id and scale
+    cout << "\nLoading diagonal bank...";
+    unique_ptr<DiagonalBank> bank = Open_Diagonal_Bank(bank_directory, dimension, session);
+    const vector<Plaintext> &U_sigma_diagonals_plain = Get_Bank_Diagonals(*bank, BANK_U_SIGMA)[0];
+    const vector<Plaintext> &U_tau_diagonals_plain = Get_Bank_Diagonals(*bank, BANK_U_TAU)[0];
+    const vector<vector<Plaintext>> &V_k_diagonals_plain = Get_Bank_Diagonals(*bank, BANK_V_K);
+    const vector<vector<Plaintext>> &W_k_diagonals_plain = Get_Bank_Diagonals(*bank, BANK_W_K);
     cout << "Done" << endl;
 
     // Encode Matrices
@@ -410,7 +158,7 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
     // --------------- MATRIX MULTIPLICATION ----------------
     cout << "\nMatrix Multiplication...";
     cout << "test " << endl;
-    Ciphertext ct_result = CC_Matrix_Multiplication(cipher_encoded_matrix1_set1, cipher_encoded_matrix2_set1, dimension, U_sigma_diagonals_plain, U_tau_diagonals_plain, V_k_diagonals_plain, W_k_diagonals_plain, gal_keys, params);
+    Ciphertext ct_result = CC_Matrix_Multiplication(cipher_encoded_matrix1_set1, cipher_encoded_matrix2_set1, dimension, U_sigma_diagonals_plain, U_tau_diagonals_plain, V_k_diagonals_plain, W_k_diagonals_plain, session, num_threads);
     cout << "Done" << endl;
 
     // --------------- DECRYPT ----------------
@@ -444,10 +192,10 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
 
     cout << "----------Step 1----------- " << endl;
     // Step 1-1
-    ctA_result[0] = Linear_Transform_Plain(cipher_encoded_matrix1_set1, U_sigma_diagonals_plain, gal_keys, params);
+    ctA_result[0] = Linear_Transform_Plain(cipher_encoded_matrix1_set1, U_sigma_diagonals_plain, session);
 
     // Step 1-2
-    ctB_result[0] = Linear_Transform_Plain(cipher_encoded_matrix2_set1, U_tau_diagonals_plain, gal_keys, params);
+    ctB_result[0] = Linear_Transform_Plain(cipher_encoded_matrix2_set1, U_tau_diagonals_plain, session);
 
     // TEST CTA _ RESULT [0]
     Plaintext cta_0;
@@ -489,8 +237,8 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
     for (int k = 1; k < dimension; k++)
     {
         cout << "Linear Transf at k = " << k;
-        ctA_result[k] = Linear_Transform_Plain(ctA_result[0], V_k_diagonals_plain[k - 1], gal_keys, params);
-        ctB_result[k] = Linear_Transform_Plain(ctB_result[0], W_k_diagonals_plain[k - 1], gal_keys, params);
+        ctA_result[k] = Linear_Transform_Plain(ctA_result[0], V_k_diagonals_plain[k - 1], session);
+        ctB_result[k] = Linear_Transform_Plain(ctB_result[0], W_k_diagonals_plain[k - 1], session);
         cout << "..... Done" << endl;
     }
 
@@ -528,10 +276,92 @@ void Matrix_Multiplication(size_t poly_modulus_degree, int dimension)
     */
 }
 
-int main()
+// Tiled multiplication of a random m x k matrix by a random k x n matrix (no padding needed by the caller)
+void Tiled_Matrix_Multiplication_Example(const ParameterPlan &parameter_plan, int m, int k, int n, int num_threads, const string &bank_directory)
 {
+    size_t poly_modulus_degree = parameter_plan.poly_modulus_degree;
+    EncryptionParameters params(scheme_type::CKKS);
+    params.set_poly_modulus_degree(poly_modulus_degree);
+    params.set_coeff_modulus(CoeffModulus::Create(poly_modulus_degree, parameter_plan.bit_sizes));
 
-    Matrix_Multiplication(8192 * 2, 4);
+    // Create Scale
+    double scale = pow(2.0, parameter_plan.scale_bits);
+
+    // Rotation steps of the run, only their Galois keys are generated
+    RotationPlan plan(poly_modulus_degree / 2);
+    Plan_Tiled_Matrix_Multiplication(plan, m, k, n);
+    int tile = Tile_Dimension(m, k, n, poly_modulus_degree / 2);
+    cout << "\nTiled multiplication " << m << "x" << k << " * " << k << "x" << n << ": " << tile << "x" << tile << " tiles, "
+         << CC_Batch_Capacity(tile, poly_modulus_degree / 2) << " block products per call" << endl;
+
+    HESession session(params, scale, 1, Plan_Galois_Steps(plan));
+
+    vector<vector<double>> A(m, vector<double>(k));
+    vector<vector<double>> B(k, vector<double>(n));
+    for (auto &row : A)
+    {
+        for (auto &value : row)
+        {
+            value = ((double)rand() / (RAND_MAX));
+        }
+    }
+    for (auto &row : B)
+    {
+        for (auto &value : row)
+        {
+            value = ((double)rand() / (RAND_MAX));
+        }
+    }
+
+    auto start = chrono::high_resolution_clock::now();
+    vector<vector<double>> C = Tiled_Matrix_Multiplication(A, B, session, num_threads, bank_directory);
+    auto stop = chrono::high_resolution_clock::now();
+    auto duration = chrono::duration_cast<chrono::microseconds>(stop - start);
+
+    double max_error = 0;
+    for (int i = 0; i < m; i++)
+    {
+        for (int j = 0; j < n; j++)
+        {
+            double expected = 0;
+            for (int l = 0; l < k; l++)
+            {
+                expected += A[i][l] * B[l][j];
+            }
+            max_error = max(max_error, abs(C[i][j] - expected));
+        }
+    }
+    cout << "Tiled multiplication duration:\t" << duration.count() << " us" << endl;
+    cout << "Max error:\t" << max_error << endl;
+}
+
+int main(int argc, char **argv)
+{
+    // Runtime configuration (config file and flags, see --help)
+    Config config = Load_Config(argc, argv, {
+        {"poly_modulus_degree", "smallest poly modulus degree of both examples (default 0)"},
+        {"precision_bits", "fractional bits kept by the products (default 20)"},
+        {"integer_bits", "integer bits of the products (default 16)"},
+        {"dimension", "dimension of the square matrices (default 4)"},
+        {"tile_m", "rows of the tiled product (default 200)"},
+        {"tile_k", "inner dimension of the tiled product (default 8)"},
+        {"tile_n", "columns of the tiled product (default 200)"},
+        {"threads", "threads of the parallel loops (default: hardware threads)"},
+        {"bank_directory", "directory of the diagonal bank files (default .)"},
+    });
+    size_t min_poly_modulus_degree = Config_Int(config, "poly_modulus_degree", 0);
+    int precision_bits = Config_Int(config, "precision_bits", 20);
+    int integer_bits = Config_Int(config, "integer_bits", 16);
+    int num_threads = Config_Int(config, "threads", thread::hardware_concurrency());
+    int dimension = Config_Int(config, "dimension", 4);
+    string bank_directory = Config_String(config, "bank_directory", ".");
+
+    // Smallest parameters for the depth of CC_Matrix_Multiplication (a matrix and its copy per ciphertext for the first example)
+    ParameterPlan parameter_plan = Plan_Parameters(CC_Matrix_Multiplication_Depth(), precision_bits, integer_bits, CC_Batch_Stride(dimension), min_poly_modulus_degree);
+    Matrix_Multiplication(parameter_plan, dimension, num_threads, bank_directory);
+
+    parameter_plan = Plan_Parameters(CC_Matrix_Multiplication_Depth(), precision_bits, integer_bits, 1, min_poly_modulus_degree);
+    Tiled_Matrix_Multiplication_Example(parameter_plan, Config_Int(config, "tile_m", 200), Config_Int(config, "tile_k", 8), Config_Int(config, "tile_n", 200), num_threads, bank_directory);
 
     return 0;
 }
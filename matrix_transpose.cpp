@@ -7,37 +7,47 @@
 using namespace std;
 using namespace seal;
 
-void MatrixTranspose(size_t poly_modulus_degree, int dimension)
+void MatrixTranspose(const ParameterPlan &parameter_plan, int dimension)
 {
-    // Handle Rotation Error First
-    if (dimension > poly_modulus_degree / 4)
+    size_t poly_modulus_degree = parameter_plan.poly_modulus_degree;
+
+    // Handle Rotation Error First: Linear_Transform_Plain_Sparse copies the dimension^2 slots of the matrix into the next dimension^2 slots
+    if (2 * dimension * dimension > poly_modulus_degree / 2)
     {
-        cerr << "Dimension is too large. Choose a dimension less than " << poly_modulus_degree / 4 << endl;
+        cerr << "Dimension is too large: " << 2 * dimension * dimension << " slots are needed but poly_modulus_degree " << poly_modulus_degree << " only has " << poly_modulus_degree / 2 << endl;
         exit(1);
     }
 
     EncryptionParameters params(scheme_type::CKKS);
     params.set_poly_modulus_degree(poly_modulus_degree);
     cout << "MAX BIT COUNT: " << CoeffModulus::MaxBitCount(poly_modulus_degree) << endl;
-    params.set_coeff_modulus(CoeffModulus::Create(poly_modulus_degree, {60, 40, 40, 40, 40, 60}));
-    auto context = SEALContext::Create(params);
-
-    // Generate keys, encryptor, decryptor and evaluator
-    KeyGenerator keygen(context);
-    PublicKey pk = keygen.public_key();
-    SecretKey sk = keygen.secret_key();
-    GaloisKeys gal_keys = keygen.galois_keys();
-    RelinKeys relin_keys = keygen.relin_keys();
-
-    Encryptor encryptor(context, pk);
-    Evaluator evaluator(context);
-    Decryptor decryptor(context, sk);
-
-    // Create CKKS encoder
-    CKKSEncoder ckks_encoder(context);
+    params.set_coeff_modulus(CoeffModulus::Create(poly_modulus_degree, parameter_plan.bit_sizes));
 
     // Create Scale
-    double scale = pow(2.0, 40);
+    double scale = pow(2.0, parameter_plan.scale_bits);
+
+    // Get the non-zero diagonals of U_transposed (2 * dimension - 1 of them)
+    SparseDiagonals U_transposed_diagonals = get_permutation_diagonals(get_U_transpose_permutation(dimension));
+    cout << "\nU_tranposed: " << U_transposed_diagonals.diagonals.size() << " non-zero diagonals" << endl;
+
+    // Rotation steps of the run, only their Galois keys are generated
+    RotationPlan plan(poly_modulus_degree / 2);
+    Plan_C_Matrix_Encode(plan, dimension);
+    Plan_Linear_Transform_Plain_Sparse(plan, U_transposed_diagonals);
+    Plan_C_Matrix_Decode(plan, dimension);
+    // Dot product of the dummy test
+    Plan_Rotate_And_Sum(plan, 4, true);
+    cout << "Galois keys: " << plan.steps.size() << " rotation steps" << endl;
+
+    // Create the HE session (context, keys, encryptor, evaluator, decryptor and encoder) shared by all routines
+    HESession session(params, scale, 1, Plan_Galois_Steps(plan));
+    auto context = session.context;
+    GaloisKeys &gal_keys = session.gal_keys;
+    RelinKeys &relin_keys = session.relin_keys;
+    Encryptor &encryptor = session.encryptor;
+    Evaluator &evaluator = session.evaluator;
+    Decryptor &decryptor = session.decryptor;
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
 
     int dimensionSq = pow(dimension, 2);
 
@@ -61,33 +71,10 @@ void MatrixTranspose(size_t poly_modulus_degree, int dimension)
     cout << "Matrix 1:" << endl;
     print_full_matrix(pod_matrix1_set1, 0);
 
-    // Get U_tranposed
-    vector<vector<double>> U_transposed = get_U_transpose(pod_matrix1_set1);
-
-    cout << "\nU_tranposed:" << endl;
-    print_full_matrix(U_transposed, 0);
-
-    // Get diagonals for U_transposed
-    vector<vector<double>> U_transposed_diagonals = get_all_diagonals(U_transposed);
-
-    // Test ADD EPSILON
-    double epsilon = 0.00000001;
-    for (int i = 0; i < dimensionSq; i++)
-    {
-        for (int j = 0; j < dimensionSq; j++)
-        {
-            U_transposed_diagonals[i][j] += epsilon;
-        }
-    }
-
     // --------------- ENCODING ----------------
-    // Encode U_transposed_diagonals
-    vector<Plaintext> U_transposed_diagonals_plain(dimensionSq);
+    // Encode the non-zero U_transposed diagonals
     cout << "\nEncoding U_tranposed_diagonals...";
-    for (int i = 0; i < dimensionSq; i++)
-    {
-        ckks_encoder.encode(U_transposed_diagonals[i], scale, U_transposed_diagonals_plain[i]);
-    }
+    SparsePlainDiagonals U_transposed_diagonals_plain = Encode_Sparse_Diagonals(U_transposed_diagonals, scale, ckks_encoder);
     cout << "Done" << endl;
 
     // Encode Matrix 1
@@ -118,7 +105,7 @@ void MatrixTranspose(size_t poly_modulus_degree, int dimension)
 
     // --------------- MATRIX TRANSPOSING ----------------
     cout << "\nMatrix Transposition...";
-    Ciphertext ct_result = Linear_Transform_Plain(cipher_encoded_matrix1_set1, U_transposed_diagonals_plain, gal_keys, params);
+    Ciphertext ct_result = Linear_Transform_Plain_Sparse(cipher_encoded_matrix1_set1, U_transposed_diagonals_plain, session);
     cout << "Done" << endl;
 
     // --------------- DECRYPT ----------------
@@ -226,9 +213,25 @@ void MatrixTranspose(size_t poly_modulus_degree, int dimension)
          << endl;
 }
 
-int main()
+int main(int argc, char **argv)
 {
-    MatrixTranspose(8192 * 2, 4);
+    // Runtime configuration (config file and flags, see --help)
+    Config config = Load_Config(argc, argv, {
+        {"poly_modulus_degree", "smallest poly modulus degree (default 0)"},
+        {"precision_bits", "fractional bits kept by the products (default 20)"},
+        {"integer_bits", "integer bits of the products (default 16)"},
+        {"dimension", "dimension of the square matrix (default 4)"},
+    });
+    size_t min_poly_modulus_degree = Config_Int(config, "poly_modulus_degree", 0);
+    int precision_bits = Config_Int(config, "precision_bits", 20);
+    int integer_bits = Config_Int(config, "integer_bits", 16);
+    int dimension = Config_Int(config, "dimension", 4);
+
+    // The transposition and the decode mask are not rescaled, the decoded rows keep both products in the modulus.
+    // C_Matrix_Encode fills dimension^2 slots and Linear_Transform_Plain_Sparse duplicates them.
+    int depth = max(Linear_Transform_Plain_Sparse_Depth() + C_Matrix_Decode_Depth(), Cipher_Dot_Product_Depth());
+    ParameterPlan parameter_plan = Plan_Parameters(depth, precision_bits, integer_bits, 2 * dimension * dimension, min_poly_modulus_degree);
+    MatrixTranspose(parameter_plan, dimension);
 
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,133 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <sstream>
+#include "seal/seal.h"
+
+#include "helper.h"
+
+using namespace std;
+using namespace seal;
+
+// Size in bytes of a SEAL object (serialized without compression)
+template <typename T>
+size_t byte_size(const T &object)
+{
+    stringstream stream;
+    return object.save(stream, compr_mode_type::none);
+}
+
+template <typename T>
+size_t byte_size(const vector<T> &objects)
+{
+    size_t size = 0;
+    for (auto &object : objects)
+    {
+        size += byte_size(object);
+    }
+    return size;
+}
+
+// Calls of the previous API: every by value argument is copied before the call (copies made inside the old helpers are not counted)
+Ciphertext Linear_Transform_Plain_BSGS_by_value(Ciphertext ct, vector<Plaintext> U_diagonals, GaloisKeys gal_keys, HESession &session)
+{
+    return Linear_Transform_Plain_BSGS(ct, U_diagonals, session);
+}
+
+Ciphertext cipher_dot_product_by_value(Ciphertext ctA, Ciphertext ctB, int size, RelinKeys relin_keys, GaloisKeys gal_keys, Evaluator &evaluator)
+{
+    return cipher_dot_product(ctA, ctB, size, relin_keys, gal_keys, evaluator);
+}
+
+// Runs call runs times and prints its average duration, the bytes copied per call and the growth of the global memory pool
+void Benchmark_Call(string name, size_t copied_bytes, int runs, function<void()> call)
+{
+    size_t pool_start = MemoryManager::GetPool().alloc_byte_count();
+    auto start = chrono::high_resolution_clock::now();
+    for (int i = 0; i < runs; i++)
+    {
+        call();
+    }
+    auto stop = chrono::high_resolution_clock::now();
+    size_t pool_stop = MemoryManager::GetPool().alloc_byte_count();
+
+    auto duration = chrono::duration_cast<chrono::microseconds>(stop - start);
+    cout << left << setw(40) << name << "\t" << duration.count() / runs << " us\t"
+         << copied_bytes / 1024 << " KB copied\t" << (pool_stop - pool_start) / 1024 << " KB pool growth" << endl;
+}
+
+void Memory_Benchmark(size_t poly_modulus_degree, int num_diagonals, int runs)
+{
+    EncryptionParameters params(scheme_type::CKKS);
+    params.set_poly_modulus_degree(poly_modulus_degree);
+    params.set_coeff_modulus(CoeffModulus::Create(poly_modulus_degree, {60, 40, 40, 40, 40, 60}));
+
+    // Create Scale
+    double scale = pow(2.0, 40);
+
+    // Create the HE session (context, keys, encryptor, evaluator, decryptor and encoder) shared by all routines
+    HESession session(params, scale);
+    GaloisKeys &gal_keys = session.gal_keys;
+    RelinKeys &relin_keys = session.relin_keys;
+    Encryptor &encryptor = session.encryptor;
+    Evaluator &evaluator = session.evaluator;
+    CKKSEncoder &ckks_encoder = session.ckks_encoder;
+
+    // Random vector and matrix diagonals
+    vector<double> pod_vec(num_diagonals);
+    vector<vector<double>> diagonals(num_diagonals, vector<double>(num_diagonals));
+    for (int i = 0; i < num_diagonals; i++)
+    {
+        pod_vec[i] = RandomFloat(-1, 1);
+        for (int j = 0; j < num_diagonals; j++)
+        {
+            diagonals[i][j] = RandomFloat(-1, 1);
+        }
+    }
+
+    Plaintext pt;
+    ckks_encoder.encode(pod_vec, scale, pt);
+    Ciphertext ct;
+    encryptor.encrypt(pt, ct);
+    vector<Plaintext> diagonals_plain = BSGS_Encode_Diagonals(diagonals, scale, ckks_encoder);
+    vector<Ciphertext> cts(num_diagonals, ct);
+
+    cout << "Poly modulus degree:\t" << poly_modulus_degree << endl;
+    cout << "Galois keys:\t" << byte_size(gal_keys) / 1024 << " KB" << endl;
+    cout << "Relin keys:\t" << byte_size(relin_keys) / 1024 << " KB" << endl;
+    cout << "Ciphertext:\t" << byte_size(ct) / 1024 << " KB" << endl;
+    cout << "Diagonals:\t" << byte_size(diagonals_plain) / 1024 << " KB (" << num_diagonals << " plaintexts)" << endl;
+    cout << endl;
+
+    Benchmark_Call("Linear_Transform_Plain_BSGS (by value)", byte_size(ct) + byte_size(diagonals_plain) + byte_size(gal_keys), runs, [&]() {
+        Linear_Transform_Plain_BSGS_by_value(ct, diagonals_plain, gal_keys, session);
+    });
+    Benchmark_Call("Linear_Transform_Plain_BSGS (const ref)", 0, runs, [&]() {
+        Linear_Transform_Plain_BSGS(ct, diagonals_plain, session);
+    });
+
+    Benchmark_Call("cipher_dot_product (by value)", 2 * byte_size(ct) + byte_size(relin_keys) + byte_size(gal_keys), runs, [&]() {
+        cipher_dot_product_by_value(ct, ct, num_diagonals, relin_keys, gal_keys, evaluator);
+    });
+    Benchmark_Call("cipher_dot_product (const ref)", 0, runs, [&]() {
+        cipher_dot_product(ct, ct, num_diagonals, relin_keys, gal_keys, evaluator);
+    });
+
+    // Both calls start from fresh partial results, as in the loops that fill them
+    Benchmark_Call("add_tree (copy)", byte_size(cts), runs, [&]() {
+        vector<Ciphertext> partial_results(cts);
+        add_tree(partial_results, evaluator);
+    });
+    Benchmark_Call("add_tree (move)", 0, runs, [&]() {
+        vector<Ciphertext> partial_results(cts);
+        add_tree(move(partial_results), evaluator);
+    });
+}
+
+int main()
+{
+
+    Memory_Benchmark(8192 * 2, 64, 5);
+
+    return 0;
+}
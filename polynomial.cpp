@@ -3,100 +3,13 @@
 #include <fstream>
 #include <unistd.h>
 #include "seal/seal.h"
+#include "helper.h"
 
 using namespace std;
 using namespace seal;
 
-// Helper function that prints parameters
-void print_parameters(shared_ptr<SEALContext> context)
-{
-    // Verify parameters
-    if (!context)
-    {
-        throw invalid_argument("context is not set");
-    }
-    auto &context_data = *context->key_context_data();
-
-    string scheme_name;
-    switch (context_data.parms().scheme())
-    {
-    case scheme_type::BFV:
-        scheme_name = "BFV";
-        break;
-    case scheme_type::CKKS:
-        scheme_name = "CKKS";
-        break;
-    default:
-        throw invalid_argument("unsupported scheme");
-    }
-    cout << "/" << endl;
-    cout << "| Encryption parameters :" << endl;
-    cout << "|   scheme: " << scheme_name << endl;
-    cout << "|   poly_modulus_degree: " << context_data.parms().poly_modulus_degree() << endl;
-
-    cout << "|   coeff_modulus size: ";
-    cout << context_data.total_coeff_modulus_bit_count() << " (";
-    auto coeff_modulus = context_data.parms().coeff_modulus();
-    size_t coeff_mod_count = coeff_modulus.size();
-    for (size_t i = 0; i < coeff_mod_count - 1; i++)
-    {
-        cout << coeff_modulus[i].bit_count() << " + ";
-    }
-    cout << coeff_modulus.back().bit_count();
-    cout << ") bits" << endl;
-
-    if (context_data.parms().scheme() == scheme_type::BFV)
-    {
-        cout << "|   plain_modulus: " << context_data.parms().plain_modulus().value() << endl;
-    }
-
-    cout << "\\" << endl;
-}
-
-void compute_all_powers(const Ciphertext &ctx, int degree, Evaluator &evaluator, RelinKeys &relin_keys, vector<Ciphertext> &powers)
-{
-
-    powers.resize(degree + 1);
-    powers[1] = ctx;
-
-    vector<int> levels(degree + 1, 0);
-    levels[1] = 0;
-    levels[0] = 0;
-
-    for (int i = 2; i <= degree; i++)
-    {
-        // compute x^i
-        int minlevel = i;
-        int cand = -1;
-        for (int j = 1; j <= i / 2; j++)
-        {
-            int k = i - j;
-            //
-            int newlevel = max(levels[j], levels[k]) + 1;
-            if (newlevel < minlevel)
-            {
-                cand = j;
-                minlevel = newlevel;
-            }
-        }
-        levels[i] = minlevel;
-        // use cand
-        if (cand < 0)
-            throw runtime_error("error");
-        //cout << "levels " << i << " = " << levels[i] << endl;
-        // cand <= i - cand by definition
-        Ciphertext temp = powers[cand];
-        evaluator.mod_switch_to_inplace(temp, powers[i - cand].parms_id());
-
-        evaluator.multiply(temp, powers[i - cand], powers[i]);
-        evaluator.relinearize_inplace(powers[i], relin_keys);
-        evaluator.rescale_to_next_inplace(powers[i]);
-    }
-    return;
-}
-
 // Horner's method for polynomial evaluation
-void horner(int degree, double x)
+void horner(int degree, double x, int precision_bits, int integer_bits)
 {
 
     chrono::high_resolution_clock::time_point time_start, time_end;
@@ -104,17 +17,15 @@ void horner(int degree, double x)
 
     EncryptionParameters parms(scheme_type::CKKS);
 
-    size_t poly_modulus_degree = 32768;
-    parms.set_poly_modulus_degree(poly_modulus_degree);
-
-    vector<int> moduli(degree + 4, 40);
-    moduli[0] = 50;
-    moduli[moduli.size() - 1] = 59;
+    // Smallest parameters for one rescale per coefficient
+    ParameterPlan plan = Plan_Parameters(Horner_Depth(degree), precision_bits, integer_bits);
 
+    size_t poly_modulus_degree = plan.poly_modulus_degree;
+    parms.set_poly_modulus_degree(poly_modulus_degree);
     parms.set_coeff_modulus(CoeffModulus::Create(
-        poly_modulus_degree, moduli));
+        poly_modulus_degree, plan.bit_sizes));
 
-    double scale = pow(2.0, 40);
+    double scale = pow(2.0, plan.scale_bits);
 
     auto context = SEALContext::Create(parms);
 
@@ -206,7 +117,7 @@ void horner(int degree, double x)
         evaluator.mod_switch_to_inplace(plain_coeffs[i], temp.parms_id());
 
         // Manual rescale
-        temp.scale() = pow(2.0, 40);
+        temp.scale() = scale;
         evaluator.add_plain_inplace(temp, plain_coeffs[i]);
 
         //cout << i << "-th iteration done" << endl;
@@ -230,25 +141,29 @@ void horner(int degree, double x)
 }
 
 // Tree method for polynomial evaluation
-void tree(int degree, double x)
+void tree(int degree, double x, int precision_bits, int integer_bits)
 {
     chrono::high_resolution_clock::time_point time_start, time_end;
     chrono::microseconds time_diff;
 
     EncryptionParameters parms(scheme_type::CKKS);
 
-    int depth = ceil(log2(degree));
+    // Random Coefficients from 0-1
+    vector<double> coeffs(degree + 1);
+    for (size_t i = 0; i < degree + 1; i++)
+    {
+        coeffs[i] = (double)rand() / RAND_MAX;
+    }
 
-    vector<int> moduli(depth + 4, 40);
-    moduli[0] = 50;
-    moduli[moduli.size() - 1] = 59;
+    // Smallest parameters for the powers of the non-zero terms and the products with their coefficients
+    ParameterPlan plan = Plan_Parameters(Tree_Depth(coeffs), precision_bits, integer_bits);
 
-    size_t poly_modulus_degree = 16384;
+    size_t poly_modulus_degree = plan.poly_modulus_degree;
     parms.set_poly_modulus_degree(poly_modulus_degree);
     parms.set_coeff_modulus(CoeffModulus::Create(
-        poly_modulus_degree, moduli));
+        poly_modulus_degree, plan.bit_sizes));
 
-    double scale = pow(2.0, 40);
+    double scale = pow(2.0, plan.scale_bits);
 
     auto context = SEALContext::Create(parms);
 
@@ -271,15 +186,12 @@ void tree(int degree, double x)
     encryptor.encrypt(ptx, ctx);
     cout << "x = " << x << endl;
 
-    vector<double> coeffs(degree + 1);
     vector<Plaintext> plain_coeffs(degree + 1);
 
-    // Random Coefficients from 0-1
     cout << "Polynomial = ";
     int counter = 0;
     for (size_t i = 0; i < degree + 1; i++)
     {
-        coeffs[i] = (double)rand() / RAND_MAX;
         ckks_encoder.encode(coeffs[i], scale, plain_coeffs[i]);
         cout << "x^" << counter << " * (" << coeffs[i] << ")"
              << ", ";
@@ -334,8 +246,8 @@ void tree(int degree, double x)
         evaluator.mod_switch_to_inplace(enc_result, temp.parms_id());
         
         // Manual Rescale
-        enc_result.scale() = pow(2.0, 40);
-        temp.scale() = pow(2.0, 40);
+        enc_result.scale() = scale;
+        temp.scale() = scale;
         
         evaluator.add_inplace(enc_result, temp);
         // cout << i << "-th sum done" << endl;
@@ -358,8 +270,15 @@ void tree(int degree, double x)
     cout << "Actual : " << result[0] << "\nExpected : " << expected_result << "\ndiff : " << abs(result[0] - expected_result) << endl;
 }
 
-int main()
+int main(int argc, char **argv)
 {
+    // Runtime configuration (config file and flags, see --help)
+    Config config = Load_Config(argc, argv, {
+        {"precision_bits", "fractional bits kept by the result (default 25)"},
+        {"integer_bits", "integer bits of the result (default 10)"},
+    });
+    int precision_bits = Config_Int(config, "precision_bits", 25);
+    int integer_bits = Config_Int(config, "integer_bits", 10);
 
     int degree = 0;
     cout << "Enter Degree: ";
@@ -396,11 +315,11 @@ int main()
         switch (selection)
         {
         case 1:
-            horner(degree, x);
+            horner(degree, x, precision_bits, integer_bits);
             break;
 
         case 2:
-            tree(degree, x);
+            tree(degree, x, precision_bits, integer_bits);
             break;
 
         case 0: